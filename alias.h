@@ -0,0 +1,77 @@
+// Walker's alias table for O(1) sampling from a fixed discrete distribution.
+//
+// Usage:
+//   AliasTable table;
+//   table.Build(topic, weight, n); // O(n)
+//   int k = table.Draw(Unif01());  // O(1)
+//
+// Note:
+// - Weights need not be normalized, mass_ holds their sum.
+// - A table is considered stale once it has served as many draws as it has
+//   entries, which amortizes the rebuild cost to O(1) per draw.
+#pragma once
+
+#include "util.h"
+
+#include <vector>
+#include <algorithm>
+
+struct AliasTable {
+  std::vector<float> prob_; // probability of keeping the slot's own topic
+  std::vector<int> topic_, alias_; // own and alias topic of every slot
+  std::vector<int> small_, large_; // scratch for Build()
+  std::vector<real> scaled_;
+  real mass_ = 0.0;
+  int num_draw_ = 0;
+
+  void Build(const int *topic, const real *weight, int n) {
+    prob_.resize(n);
+    topic_.assign(topic, topic + n);
+    alias_.assign(topic, topic + n);
+    scaled_.resize(n);
+    small_.clear();
+    large_.clear();
+    mass_ = 0.0;
+    for (int i = 0; i < n; ++i) {
+      mass_ += weight[i];
+    }
+    for (int i = 0; i < n; ++i) {
+      scaled_[i] = weight[i] * n / mass_;
+      if (scaled_[i] < 1.0) {
+        small_.push_back(i);
+      } else {
+        large_.push_back(i);
+      }
+    }
+    while (!small_.empty() and !large_.empty()) { // Vose's method
+      int s = small_.back();
+      int l = large_.back();
+      small_.pop_back();
+      prob_[s] = scaled_[s];
+      alias_[s] = topic_[l];
+      scaled_[l] -= 1.0 - scaled_[s];
+      if (scaled_[l] < 1.0) {
+        large_.pop_back();
+        small_.push_back(l);
+      }
+    }
+    for (int i : small_) { // numerical leftovers
+      prob_[i] = 1.0;
+    }
+    for (int i : large_) {
+      prob_[i] = 1.0;
+    }
+    num_draw_ = 0;
+  }
+
+  bool Stale() const {
+    return num_draw_ >= (int)prob_.size();
+  }
+
+  int Draw(real u) { // u is uniform in [0,1)
+    ++num_draw_;
+    real x = u * prob_.size();
+    int i = std::min((int)x, (int)prob_.size() - 1);
+    return (x - i < prob_[i]) ? topic_[i] : alias_[i];
+  }
+};
@@ -0,0 +1,225 @@
+// Benchmarks of the corpus reader, the count table, the samplers and the
+// evaluators on a synthetic corpus. Every result is appended to bench_out as
+// one JSON object per line, so runs of different builds can be compared.
+//
+// Usage:
+//   make bench
+//   ./sparselda_bench -gen_doc 20000 -num_topic 1000 -bench_out bench.jsonl
+//
+// Note:
+// - Trainer flags like -num_topic, -num_thread and -mh_step apply as usual.
+// - Each benchmark runs bench_repeat times and reports the fastest run.
+#include "../flag.h"
+#include "../timer.h"
+#include "../corpus.h"
+#include "../trainer.h"
+#include "synthetic.h"
+
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+auto *gen_doc = flag.Int("gen_doc", 20000, "Synthetic training documents");
+auto *gen_word = flag.Int("gen_word", 20000, "Synthetic vocabulary size");
+auto *gen_topic = flag.Int("gen_topic", 100, "Topics the synthetic corpus is drawn from");
+auto *gen_length = flag.Int("gen_length", 100, "Mean synthetic document length");
+auto *gen_zipf = flag.Float("gen_zipf", 1.0, "Zipf exponent of word ranks within a topic");
+auto *gen_dir = flag.String("gen_dir", "/tmp", "Directory for the synthetic corpus files");
+auto *bench_out = flag.String("bench_out", "bench.jsonl", "File the JSON lines results are appended to");
+auto *bench_label = flag.String("bench_label", "", "Build label stored with every result, e.g. a commit");
+auto *bench_repeat = flag.Int("bench_repeat", 3, "Runs per benchmark, the fastest is reported");
+auto *bench_warmup = flag.Int("bench_warmup", 2, "Sweeps before the samplers are timed");
+
+static void set_flag(const char *name, const std::string& value) {
+  auto it = flag.body_.find(name);
+  if (it == flag.body_.end()) {
+    lg.Fatalf("flag undefined: %s", name);
+  }
+  it->second->value_.Set(value.c_str());
+}
+
+static int flag_int(const char *name) {
+  return *reinterpret_cast<int*>(flag.body_.find(name)->second->value_.buf_);
+}
+
+static std::string flag_string(const char *name) {
+  return *reinterpret_cast<std::string*>(flag.body_.find(name)->second->value_.buf_);
+}
+
+struct Bench {
+  FILE *out_;
+  std::string train_file_, test_file_;
+  long long num_token_ = 0;
+
+  // Fastest of bench_repeat runs of f, in seconds
+  template <typename F>
+  static double best_of(F f) {
+    double best = 1e300;
+    for (int i = 0; i < std::max(1, *bench_repeat); ++i) {
+      double start = get_time();
+      f();
+      best = std::min(best, get_time() - start);
+    }
+    return best;
+  }
+
+  void report(const char *name, double value, const char *unit, double sec) {
+    fprintf(out_, "{\"bench\":\"%s\",\"value\":%.6g,\"unit\":\"%s\",\"sec\":%.6g,"
+                  "\"label\":\"%s\",\"time\":%lld,"
+                  "\"doc\":%d,\"word\":%d,\"gen_topic\":%d,\"length\":%d,\"zipf\":%g,"
+                  "\"token\":%lld,\"topic\":%d,\"thread\":%d}\n",
+            name, value, unit, sec, bench_label->c_str(), (long long)time(NULL),
+            *gen_doc, *gen_word, *gen_topic, *gen_length, *gen_zipf,
+            num_token_, flag_int("num_topic"), flag_int("num_thread"));
+    fflush(out_);
+    lg.Printf("%-24s %12.4g %-10s %8.4f sec", name, value, unit, sec);
+  }
+
+  void generate() {
+    SyntheticCorpus gen;
+    gen.num_doc_ = *gen_doc;
+    gen.num_word_ = *gen_word;
+    gen.num_topic_ = *gen_topic;
+    gen.doc_length_ = *gen_length;
+    gen.zipf_ = *gen_zipf;
+    char suffix[128];
+    snprintf(suffix, sizeof(suffix), "sparselda_bench_%d_%d_%d_%d_%g",
+             *gen_doc, *gen_word, *gen_topic, *gen_length, *gen_zipf);
+    train_file_ = *gen_dir + "/" + suffix + ".train";
+    test_file_ = *gen_dir + "/" + suffix + ".test";
+    double start = get_time();
+    num_token_ = gen.Write(train_file_.c_str());
+    double sec = get_time() - start;
+    gen.num_doc_ = std::max(1, *gen_doc / 20);
+    gen.seed_ = 2;
+    gen.Write(test_file_.c_str());
+    report("gen_corpus", num_token_ / sec, "token/s", sec);
+  }
+
+  void read_data() {
+    struct stat st;
+    stat(train_file_.c_str(), &st);
+    double sec = best_of([this]() {
+      Corpus corpus;
+      corpus.ReadData(train_file_.c_str(), flag_int("num_thread"));
+    });
+    report("read_data", st.st_size / sec / 1e6, "MB/s", sec);
+  }
+
+  void sparse_count() {
+    Corpus corpus;
+    corpus.ReadData(train_file_.c_str(), 1);
+    int K = flag_int("num_topic");
+    std::vector<int> topic(corpus.num_token_), next(corpus.num_token_);
+    SeedUnif01(1);
+    for (int j = 0; j < corpus.num_token_; ++j) {
+      topic[j] = Dice(K);
+      next[j] = Dice(K);
+    }
+    SparseCount nkw;
+    double sec = best_of([&]() {
+      nkw.Init(dict.size_, K, corpus.MaxWordCount());
+      for (int j = 0; j < corpus.num_token_; ++j) {
+        nkw.AddCount(corpus.tok_[j], topic[j]);
+      }
+    });
+    report("sparse_count_add", corpus.num_token_ / sec, "op/s", sec);
+    sec = best_of([&]() { // move every token to its next topic and back
+      for (int j = 0; j < corpus.num_token_; ++j) {
+        nkw.UpdateCount(corpus.tok_[j], topic[j], next[j]);
+      }
+      for (int j = 0; j < corpus.num_token_; ++j) {
+        nkw.UpdateCount(corpus.tok_[j], next[j], topic[j]);
+      }
+    });
+    report("sparse_count_update", 2.0 * corpus.num_token_ / sec, "op/s", sec);
+  }
+
+  void trainer() {
+    set_flag("train_file", train_file_);
+    set_flag("test_file", test_file_);
+    Trainer t;
+    t.initialize();
+    double tokens = t.train_.num_token_;
+    int iter = 0;
+    struct { const char *name; SamplerType type; } samplers[] = {
+      {"train_one_document", SAMPLER_SPARSE},
+      {"train_one_document_alias", SAMPLER_ALIAS},
+    };
+    for (const auto& s : samplers) {
+      t.sampler_ = s.type;
+      t.partition_documents();
+      for (int i = 0; i < *bench_warmup; ++i) {
+        t.sample_documents(++iter);
+      }
+      double sec = best_of([&]() { t.sample_documents(++iter); });
+      report(s.name, tokens / sec, "token/s", sec);
+    }
+
+    double sec = best_of([&]() { t.evaluate_joint(t.joint_doc_term(t.train_.asg_), t.nkw_, t.nk_); });
+    report("evaluate_joint", tokens / sec, "token/s", sec);
+    sec = best_of([&]() { t.llh_doc_term(t.nkw_, t.nk_, t.train_.asg_); });
+    report("evaluate_llh", tokens / sec, "token/s", sec);
+    sec = best_of([&]() { t.evaluate_test_llh(t.nkw_, t.nk_); });
+    report("evaluate_test_llh", t.test_.num_token_ / sec, "token/s", sec);
+    t_bucket_head(t);
+  }
+
+  // t bucket of the Zipf head alone, the prefix sum and the search over the
+  // rows of the 100 most frequent words, one pass per token of theirs
+  void t_bucket_head(Trainer& t) {
+    std::vector<int> freq(dict.size_, 0), word(dict.size_);
+    for (int j = 0; j < t.train_.num_token_; ++j) {
+      ++freq[t.train_.tok_[j]];
+    }
+    for (int w = 0; w < dict.size_; ++w) {
+      word[w] = w;
+    }
+    int num_head = std::min(100, dict.size_);
+    std::partial_sort(word.begin(), word.begin() + num_head, word.end(),
+                      [&freq](int a, int b) { return freq[a] > freq[b]; });
+    word.resize(num_head);
+    long long tokens = 0;
+    for (int w : word) {
+      tokens += freq[w];
+    }
+    const real *coeff = t.worker_[0].t_coeff_.data();
+    std::vector<real> head(flag_int("num_topic"));
+    for (const char *name : {"scalar", "avx2", "avx512"}) {
+      if (!Simd::Init(name)) {
+        continue;
+      }
+      volatile int sink = 0; // keeps the searches
+      double sec = best_of([&]() {
+        for (int w : word) {
+          auto row = t.nkw_.Row(w);
+          for (int i = 0; i < freq[w]; ++i) {
+            real sum = Simd::PrefixSum(row, coeff, -1, 0.0f, head.data());
+            sink += Simd::LowerBound(head.data(), row.size(), sum * (i & 1023) / 1024);
+          }
+        }
+      });
+      report((std::string("t_bucket_head_") + name).c_str(), tokens / sec, "token/s", sec);
+    }
+    Simd::Init(flag_string("simd"));
+  }
+};
+
+int main(int argc, char** argv) {
+  flag.Parse(argc, argv);
+  flag.Print();
+
+  Bench bench;
+  bench.out_ = fopen(bench_out->c_str(), "a");
+  if (bench.out_ == NULL) {
+    lg.Fatalf("cannot open %s", bench_out->c_str());
+  }
+  bench.generate();
+  bench.read_data();
+  bench.sparse_count();
+  bench.trainer();
+  fclose(bench.out_);
+  return 0;
+}
@@ -0,0 +1,109 @@
+// Synthetic corpus drawn from the LDA generative model, for benchmarks.
+//
+// Usage:
+//   SyntheticCorpus gen;
+//   gen.num_doc_ = 10000;
+//   gen.num_word_ = 20000;
+//   gen.num_topic_ = 100;
+//   gen.doc_length_ = 100;
+//   gen.zipf_ = 1.0;
+//   gen.Write("bench.train"); // LIBSVM, about num_doc_ * doc_length_ tokens
+//
+// Note:
+// - Every topic is a Zipf distribution over the vocabulary with exponent
+//   zipf_, in its own order of words. The order is an affine permutation of
+//   word ids, so topics take no memory beyond one shared rank table.
+// - Documents mix topics with a Dirichlet(alpha_) prior, their lengths are
+//   uniform in [doc_length_ / 2, doc_length_ * 3 / 2].
+// - The output only depends on the parameters and seed_.
+#pragma once
+
+#include "../util.h"
+#include "../logger.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <random>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+struct SyntheticCorpus {
+  int num_doc_ = 10000;
+  int num_word_ = 20000;
+  int num_topic_ = 100;
+  int doc_length_ = 100; // mean tokens per document
+  double zipf_ = 1.0; // word rank exponent within a topic
+  double alpha_ = 0.1; // doc topic prior
+  uint64_t seed_ = 1;
+
+  std::vector<double> rank_cdf_; // V x 1, Zipf over ranks
+  std::vector<uint64_t> scale_, shift_; // K x 1, rank to word permutation
+
+  void build_topics(std::mt19937_64& rng) {
+    rank_cdf_.resize(num_word_);
+    double sum = 0.0;
+    for (int r = 0; r < num_word_; ++r) {
+      sum += pow(r + 1.0, -zipf_);
+      rank_cdf_[r] = sum;
+    }
+    scale_.resize(num_topic_);
+    shift_.resize(num_topic_);
+    for (int k = 0; k < num_topic_; ++k) {
+      uint64_t a;
+      do { // coprime to V, so word = (a * rank + b) mod V is a permutation
+        a = rng() % num_word_;
+      } while (a == 0 or std::gcd(a, (uint64_t)num_word_) != 1);
+      scale_[k] = a;
+      shift_[k] = rng() % num_word_;
+    }
+  }
+
+  int draw_word(int k, double u) const {
+    int r = std::lower_bound(RANGE(rank_cdf_), u * rank_cdf_.back()) - rank_cdf_.begin();
+    r = std::min(r, num_word_ - 1);
+    return (scale_[k] * r + shift_[k]) % num_word_;
+  }
+
+  // Write the corpus as LIBSVM, returns the number of tokens
+  long long Write(const char *file) {
+    std::mt19937_64 rng(seed_);
+    std::uniform_real_distribution<double> unif01;
+    std::gamma_distribution<double> gamma(alpha_);
+    build_topics(rng);
+    FILE *fp = fopen(file, "w");
+    if (fp == NULL) {
+      lg.Fatalf("cannot write %s", file);
+    }
+    std::vector<double> theta_cdf(num_topic_);
+    std::vector<int> cnt(num_word_, 0), touched;
+    long long num_token = 0;
+    for (int d = 0; d < num_doc_; ++d) {
+      double sum = 0.0;
+      for (int k = 0; k < num_topic_; ++k) {
+        sum += gamma(rng);
+        theta_cdf[k] = sum;
+      }
+      int length = doc_length_ / 2 + rng() % (doc_length_ + 1);
+      touched.clear();
+      for (int i = 0; i < length; ++i) {
+        int k = std::lower_bound(RANGE(theta_cdf), unif01(rng) * sum) - theta_cdf.begin();
+        int w = draw_word(std::min(k, num_topic_ - 1), unif01(rng));
+        if (cnt[w]++ == 0) {
+          touched.push_back(w);
+        }
+      }
+      fprintf(fp, "0");
+      for (int w : touched) {
+        fprintf(fp, " %d:%d", w, cnt[w]);
+        cnt[w] = 0;
+      }
+      fprintf(fp, "\n");
+      num_token += length;
+    }
+    if (fclose(fp) != 0) {
+      lg.Fatalf("cannot write %s", file);
+    }
+    return num_token;
+  }
+};
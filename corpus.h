@@ -5,47 +5,355 @@
 #include "timer.h"
 #include "logger.h"
 #include "reader.h"
+#include "writer.h"
+#include "narrow_array.h"
 
+#include <memory>
 #include <string>
 #include <vector>
+#include <thread>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
 
-struct Document {
-  struct Pair {
-    int tok_, asg_; // token and assignment
-    Pair(int tok, int asg) : tok_(tok), asg_(asg) {}
-  };
-  std::vector<Pair> body_;
-  IArray test_nkd_; // only used in test corpus, which is small, so we can afford memory
+// Documents of one line-aligned chunk, with chunk-local word ids
+struct ParsedChunk {
+  std::vector<int> length_; // tokens per document
+  std::vector<int> tok_; // local word id of every token
+  std::vector<std::string_view> word_; // local id to word, first appearance order
+  std::vector<int> global_; // local id to dict id, filled by the merge
+  std::unordered_map<std::string_view, int> local_;
+
+  static bool is_space(char c) {
+    return c == ' ' or c == '\t' or c == '\r';
+  }
+
+  void Parse(const char *p, const char *end) {
+    while (p < end) {
+      const char *eol = (const char*)memchr(p, '\n', end - p);
+      if (eol == NULL) {
+        eol = end;
+      }
+      while (p < eol and !is_space(*p)) { // skip first field
+        ++p;
+      }
+      int line_token = 0;
+      while (true) {
+        while (p < eol and is_space(*p)) {
+          ++p;
+        }
+        if (p == eol) {
+          break;
+        }
+        const char *word = p;
+        while (p < eol and *p != ':' and !is_space(*p)) {
+          ++p;
+        }
+        std::string_view key(word, p - word);
+        int count = 0;
+        if (p < eol and *p == ':') {
+          for (++p; p < eol and *p >= '0' and *p <= '9'; ++p) {
+            count = count * 10 + (*p - '0');
+          }
+        }
+        auto it = local_.find(key);
+        int local;
+        if (it != local_.end()) {
+          local = it->second;
+        } else {
+          local = word_.size();
+          local_.emplace(key, local);
+          word_.push_back(key);
+        }
+        tok_.insert(tok_.end(), count, local);
+        line_token += count;
+        while (p < eol and !is_space(*p)) { // ignore malformed tails
+          ++p;
+        }
+      }
+      length_.push_back(line_token);
+      p = eol + 1;
+    }
+  }
+};
+
+// Binary corpus cache. Every section starts at an 8-byte boundary:
+//   CacheHeader
+//   int32_t  offset[num_doc + 1]
+//   uintW_t  token[num_token], W = 8 * tok_width, ids local to the file
+//   uint64_t word_offset[num_word + 1], into the word bytes
+//   char     word[word_bytes], vocabulary in local id order
+struct CacheHeader {
+  char magic_[8];
+  uint32_t version_, tok_width_;
+  int64_t num_doc_, num_token_, num_word_, word_bytes_;
+  int64_t source_size_, source_mtime_; // stale when the source changes
 };
 
+const char CACHE_MAGIC[8] = "LDACRPS";
+const uint32_t CACHE_VERSION = 1;
+
+// All documents in one CSR layout: tokens of document d are at positions
+// [offset_[d], offset_[d+1]) of the flat token and assignment arrays.
 struct Corpus {
-  std::vector<Document> corpus_;
+  std::vector<int> offset_; // num_doc_ + 1
+  NarrowArray tok_; // word id of every token
+  NarrowArray asg_; // topic assignment of every token
   int num_doc_, num_token_;
+  std::shared_ptr<Reader> cache_; // keeps a mapped cache alive for tok_
+
+  Corpus() : offset_(1, 0), num_doc_(0), num_token_(0) {}
+
+  int Begin(int d) const { return offset_[d]; }
+  int End(int d) const { return offset_[d + 1]; }
+  int Length(int d) const { return offset_[d + 1] - offset_[d]; }
+
+  void InitAssignment(int num_topic) {
+    asg_.Init(num_token_, num_topic - 1);
+  }
+
+  int MaxWordCount() const { // occurrences of the most frequent word
+    std::vector<int> freq;
+    int max_count = 0;
+    for (int j = 0; j < num_token_; ++j) {
+      int w = tok_[j];
+      if (w >= (int)freq.size()) {
+        freq.resize(w + 1, 0);
+      }
+      max_count = std::max(max_count, ++freq[w]);
+    }
+    return max_count;
+  }
+
+  size_t Bytes() const {
+    return offset_.size() * sizeof(int) + tok_.Bytes() + asg_.Bytes();
+  }
 
-  Corpus() : num_doc_(0), num_token_(0) {}
+  // Read a LIBSVM file, or its binary cache <file>.bin if use_cache is set.
+  // A missing or stale cache is rebuilt from the text file.
+  void Load(const char *data_file, int num_thread, bool use_cache) {
+    std::string cache_file = std::string(data_file) + ".bin";
+    if (use_cache and ReadCache(cache_file.c_str(), data_file)) {
+      return;
+    }
+    ReadData(data_file, num_thread);
+    if (use_cache) {
+      WriteCache(cache_file.c_str(), data_file);
+    }
+  }
+
+  static bool file_stat(const char *file, int64_t *size, int64_t *mtime) {
+    struct stat st;
+    if (stat(file, &st) != 0) {
+      return false;
+    }
+    *size = st.st_size;
+    *mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+  }
+
+  bool ReadCache(const char *cache_file, const char *data_file) {
+    Timer read_timer("ReadCache");
+    int64_t source_size, source_mtime, cache_size, cache_mtime;
+    if (!file_stat(cache_file, &cache_size, &cache_mtime)
+        or !file_stat(data_file, &source_size, &source_mtime)
+        or cache_size < (int64_t)sizeof(CacheHeader)) {
+      read_timer.Get();
+      return false;
+    }
+    auto reader = std::make_shared<Reader>(cache_file);
+    CacheHeader h;
+    memcpy(&h, reader->data_, sizeof(h));
+    if (memcmp(h.magic_, CACHE_MAGIC, sizeof(h.magic_)) != 0
+        or h.version_ != CACHE_VERSION
+        or h.source_size_ != source_size or h.source_mtime_ != source_mtime) {
+      lg.Printf("ignoring stale or incompatible cache %s", cache_file);
+      read_timer.Get();
+      return false;
+    }
+
+    auto corrupt = [&](const char *why) {
+      lg.Printf("ignoring corrupt cache %s: %s", cache_file, why);
+      read_timer.Get();
+      return false;
+    };
+    if (h.num_doc_ < 0 or h.num_doc_ >= INT32_MAX or h.num_token_ < 0 or h.num_token_ > INT32_MAX
+        or h.num_word_ < 0 or h.num_word_ >= INT32_MAX or h.word_bytes_ < 0
+        or (h.tok_width_ != 1 and h.tok_width_ != 2 and h.tok_width_ != 4)) {
+      return corrupt("bad header");
+    }
+
+    // Locate sections, all of them within the file
+    int64_t pos = 0;
+    auto take = [&pos, cache_size](int64_t size) { // -1 past the end
+      if (pos < 0 or size > cache_size - pos) {
+        pos = -1;
+        return (int64_t)-1;
+      }
+      int64_t begin = pos;
+      pos = std::min<int64_t>(cache_size, pos + Writer::Align8(size));
+      return begin;
+    };
+    take(sizeof(h));
+    int64_t offset_pos = take((h.num_doc_ + 1) * sizeof(int32_t));
+    int64_t token_pos = take(h.num_token_ * h.tok_width_);
+    int64_t word_offset_pos = take((h.num_word_ + 1) * sizeof(uint64_t));
+    int64_t word_pos = take(h.word_bytes_);
+    if (pos < 0) {
+      return corrupt("truncated");
+    }
+    const int32_t *offset = reinterpret_cast<const int32_t*>(reader->data_ + offset_pos);
+    const char *token = reader->data_ + token_pos;
+    const uint64_t *word_offset = reinterpret_cast<const uint64_t*>(reader->data_ + word_offset_pos);
+    const char *word = reader->data_ + word_pos;
 
-  void ReadData(const char *data_file) {
+    // Offsets and token ids, before anything goes into dict
+    if (offset[0] != 0 or offset[h.num_doc_] != h.num_token_) {
+      return corrupt("bad document offsets");
+    }
+    for (int64_t d = 0; d < h.num_doc_; ++d) {
+      if (offset[d] > offset[d + 1]) {
+        return corrupt("bad document offsets");
+      }
+    }
+    if (word_offset[0] != 0 or word_offset[h.num_word_] != (uint64_t)h.word_bytes_) {
+      return corrupt("bad word offsets");
+    }
+    for (int64_t i = 0; i < h.num_word_; ++i) {
+      if (word_offset[i] > word_offset[i + 1]) {
+        return corrupt("bad word offsets");
+      }
+    }
+    NarrowArray local;
+    local.View(token, h.num_token_, h.tok_width_);
+    for (int64_t j = 0; j < h.num_token_; ++j) {
+      if (local[j] < 0 or local[j] >= h.num_word_) {
+        return corrupt("bad token");
+      }
+    }
+
+    // Vocabulary, tokens can be used in place if local ids are global ids
+    std::vector<int> global(h.num_word_);
+    bool identity = true;
+    for (int64_t i = 0; i < h.num_word_; ++i) {
+      global[i] = dict.InsertWord(std::string_view(word + word_offset[i],
+                                                   word_offset[i + 1] - word_offset[i]));
+      identity = identity and (global[i] == i);
+    }
+    offset_.assign(offset, offset + h.num_doc_ + 1);
+    num_doc_ = h.num_doc_;
+    num_token_ = h.num_token_;
+    if (identity) { // zero copy, shared with other jobs through the page cache
+      tok_.View(token, num_token_, h.tok_width_);
+      cache_ = reader;
+    } else {
+      tok_.Init(num_token_, dict.size_ - 1);
+      for (int j = 0; j < num_token_; ++j) {
+        tok_.Set(j, global[local[j]]);
+      }
+    }
+    lg.Printf("doc = %d, token = %d, word = %d", num_doc_, num_token_, dict.size_);
+    return true;
+  }
+
+  void WriteCache(const char *cache_file, const char *data_file) {
+    Timer write_timer("WriteCache");
+    // Renumber words in first appearance order to make the file standalone
+    std::vector<int> local(dict.size_, -1), word_id;
+    NarrowArray token;
+    token.Init(num_token_, dict.size_ - 1);
+    for (int j = 0; j < num_token_; ++j) {
+      int w = tok_[j];
+      if (local[w] == -1) {
+        local[w] = word_id.size();
+        word_id.push_back(w);
+      }
+      token.Set(j, local[w]);
+    }
+    std::vector<uint64_t> word_offset(1, 0);
+    std::string word;
+    for (int w : word_id) {
+      word += dict.GetWord(w);
+      word_offset.push_back(word.size());
+    }
+
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic_, CACHE_MAGIC, sizeof(h.magic_));
+    h.version_ = CACHE_VERSION;
+    h.tok_width_ = token.width_;
+    h.num_doc_ = num_doc_;
+    h.num_token_ = num_token_;
+    h.num_word_ = word_id.size();
+    h.word_bytes_ = word.size();
+    file_stat(data_file, &h.source_size_, &h.source_mtime_);
+
+    std::vector<int32_t> offset(RANGE(offset_));
+    Writer writer(cache_file);
+    writer.Put(&h, sizeof(h));
+    writer.Put(offset.data(), offset.size() * sizeof(int32_t));
+    writer.Put(token.data(), token.Bytes());
+    writer.Put(word_offset.data(), word_offset.size() * sizeof(uint64_t));
+    writer.Put(word.data(), word.size());
+    if (!writer.Close()) {
+      lg.Printf("cannot write cache %s", cache_file);
+    }
+  }
+
+  // Parse a LIBSVM file with num_thread threads. Every thread parses one
+  // line-aligned chunk of the mapped file with its own vocabulary, which is
+  // merged into dict chunk by chunk, so word ids and document order are the
+  // same as in a sequential read.
+  void ReadData(const char *data_file, int num_thread) {
     Timer read_timer("ReadData");
     Reader reader(data_file);
-    num_token_ = reader.Read([this](char* line) {
-      Document doc;
-      char *ptr = strtok(line, " "); // skip first field
-      int line_token = 0;
-      ptr = strtok(NULL, " ");
-      while (ptr != NULL) {
-        char *colon = strchr(ptr, ':');
-        int word_id = dict.InsertWord(std::string(ptr, colon));
-        int count = strtol(colon + 1, NULL, 10);
-        for (int i = 0; i < count; ++i) {
-          doc.body_.emplace_back(word_id, -1);
-        }
-        line_token += count;
-        ptr = strtok(NULL, " ");
+    auto chunk = reader.Split(std::max(1, num_thread));
+    int num_chunk = chunk.size();
+    std::vector<ParsedChunk> parsed(num_chunk);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < num_chunk; ++c) {
+      threads.emplace_back([&chunk, &parsed, c]() {
+        parsed[c].Parse(chunk[c].begin_, chunk[c].end_);
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+
+    // Map chunk-local word ids to global ones in chunk order
+    std::vector<int> token_begin(num_chunk + 1, 0);
+    for (int c = 0; c < num_chunk; ++c) {
+      auto& pc = parsed[c];
+      pc.global_.resize(pc.word_.size());
+      for (size_t i = 0; i < pc.word_.size(); ++i) {
+        pc.global_[i] = dict.InsertWord(pc.word_[i]);
       }
-      corpus_.emplace_back(std::move(doc));
-      return line_token;
-    });
-    num_doc_ = corpus_.size();
+      token_begin[c + 1] = token_begin[c] + pc.tok_.size();
+      for (int len : pc.length_) {
+        offset_.push_back(offset_.back() + len);
+      }
+    }
+    num_doc_ = offset_.size() - 1;
+    num_token_ = token_begin[num_chunk];
+
+    // Remap tokens into the final array
+    tok_.Init(num_token_, dict.size_ - 1);
+    threads.clear();
+    for (int c = 0; c < num_chunk; ++c) {
+      threads.emplace_back([this, &parsed, &token_begin, c]() {
+        const auto& pc = parsed[c];
+        int j = token_begin[c];
+        for (int local : pc.tok_) {
+          tok_.Set(j++, pc.global_[local]);
+        }
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+    double sec = read_timer.Get();
     lg.Printf("doc = %d, token = %d, word = %d", num_doc_, num_token_, dict.size_);
+    lg.Printf("ReadData took %6.4lf sec, %.1lf MB/s with %d threads",
+              sec, reader.size_ / sec / 1e6, num_chunk);
   }
 };
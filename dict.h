@@ -1,50 +1,217 @@
 // Bidirectional mapping between word string and 0-based consecutive word id.
+//
+// Words live back to back in one arena, id_offset_ maps an id to its bytes.
+// Lookups go through an open-addressing table of (hash tag, id) slots with
+// linear probing, so a lookup hashes the key once and only touches the arena
+// on a tag match. Freeze() builds a perfect hash (hash and displace) over
+// the words so far, e.g. the training vocabulary: every lookup of one of
+// them is then one probe and one comparison.
+//
+// Note:
+// - Views returned by GetWord() are invalidated by the next InsertWord().
+// - Find() never inserts. Words inserted after Freeze(), e.g. held-out
+//   words, only go into the probing table, which lookups fall back to when
+//   the perfect hash misses.
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string>
-#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <string_view>
 
 #define D_FATAL(fmt,args...) do { \
   fprintf(stdout, fmt "\n", ##args); \
   exit(EXIT_FAILURE);  \
 } while (0)
 
+const uint32_t MAX_DISPLACEMENT = 1 << 20;
+
 struct Dict {
+  struct Slot {
+    uint32_t tag_; // high bits of the hash
+    int id_; // -1 if empty
+  };
+
   int size_ = 0;
-  std::unordered_map<std::string, int> word2id_;
-  std::unordered_map<int, std::string> id2word_;
+  std::vector<char> arena_; // all words back to back
+  std::vector<uint64_t> id_offset_ = {0}; // size_ + 1, word id to arena offset
+  std::vector<uint64_t> id_hash_; // size_, precomputed for rehashing
+  std::vector<Slot> slot_; // power of two, at most half full
+  bool frozen_ = false;
+  int num_frozen_ = 0; // words covered by the perfect hash
+  std::vector<uint32_t> disp_; // perfect hash displacement per bucket
+  std::vector<int> perfect_; // perfect hash position to word id
 
   static Dict& instance() { // singleton
     static Dict e;
     return e;
   }
-  
-  int InsertWord(const std::string& word) { // return id if exists
-    auto it = word2id_.find(word);
-    if (it != word2id_.end()) { // found
-      return it->second;
-    } else { // new
-      word2id_[word] = size_;
-      id2word_[size_] = word;
-      return size_++;
+
+  static uint64_t Hash(std::string_view word) { // FNV-1a with a final mix
+    uint64_t h = 14695981039346656037ULL;
+    for (char c : word) {
+      h = (h ^ (uint8_t)c) * 1099511628211ULL;
+    }
+    return mix(h);
+  }
+
+  static uint64_t mix(uint64_t h) { // splitmix64 finalizer
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+  }
+
+  int InsertWord(std::string_view word) { // return id if exists
+    uint64_t h = Hash(word);
+    int id = find_frozen(word, h);
+    if (id != -1) {
+      return id;
+    }
+    size_t pos = find(word, h);
+    if (slot_.size() > 0 and slot_[pos].id_ != -1) { // found
+      return slot_[pos].id_;
+    }
+    // new
+    arena_.insert(arena_.end(), word.begin(), word.end());
+    id_offset_.push_back(arena_.size());
+    id_hash_.push_back(h);
+    if (2 * (size_ + 1) > (int)slot_.size()) { // keep load factor <= 0.5
+      rehash(std::max<size_t>(16, 2 * slot_.size()));
+      pos = find(word, h);
+    }
+    slot_[pos] = {(uint32_t)(h >> 32), size_};
+    return size_++;
+  }
+
+  int GetId(std::string_view word) { // error if not exists
+    int id = Find(word);
+    if (id == -1) {
+      D_FATAL("word not found: %.*s", (int)word.size(), word.data());
     }
+    return id;
   }
 
-  int GetId(const std::string& word) { // error if not exists
-    auto it = word2id_.find(word);
-    if (it == word2id_.end()) {
-      D_FATAL("word not found: %s", word.c_str());
+  int Find(std::string_view word) const { // -1 if not exists
+    uint64_t h = Hash(word);
+    int id = find_frozen(word, h);
+    if (id != -1 or (frozen_ and size_ == num_frozen_)) {
+      return id;
+    }
+    if (slot_.empty()) {
+      return -1;
     }
-    return it->second;
+    return slot_[find(word, h)].id_;
   }
 
-  std::string GetWord(int id) { // error if not exists
-    auto it = id2word_.find(id);
-    if (it == id2word_.end()) {
+  std::string_view GetWord(int id) const { // error if not exists
+    if (id < 0 or id >= size_) {
       D_FATAL("word id not found: %d", id);
     }
-    return it->second;
+    return std::string_view(arena_.data() + id_offset_[id],
+                            id_offset_[id + 1] - id_offset_[id]);
+  }
+
+  // Build a perfect hash over the current words. Buckets are placed largest
+  // first, each trying displacements until all of its words land in free
+  // positions of a table with about 1.25 positions per word.
+  bool Freeze() { // false if no perfect hash was found, lookups still work
+    frozen_ = false;
+    int num_bucket = std::max(1, size_ / 4);
+    std::vector<std::vector<int>> bucket(num_bucket);
+    for (int id = 0; id < size_; ++id) {
+      bucket[id_hash_[id] % num_bucket].push_back(id);
+    }
+    std::vector<int> order(num_bucket);
+    for (int b = 0; b < num_bucket; ++b) {
+      order[b] = b;
+    }
+    std::sort(order.begin(), order.end(), [&bucket](int a, int b) {
+      return bucket[a].size() > bucket[b].size();
+    });
+    disp_.assign(num_bucket, 0);
+    perfect_.assign(size_ + size_ / 4 + 1, -1);
+    std::vector<size_t> pos;
+    for (int b : order) {
+      for (uint32_t d = 0; ; ++d) {
+        if (d == MAX_DISPLACEMENT) { // only on full 64-bit hash collisions
+          return false;
+        }
+        pos.clear();
+        bool ok = true;
+        for (int id : bucket[b]) {
+          size_t p = perfect_pos(id_hash_[id], d);
+          if (perfect_[p] != -1 or std::count(pos.begin(), pos.end(), p) > 0) {
+            ok = false;
+            break;
+          }
+          pos.push_back(p);
+        }
+        if (ok) {
+          disp_[b] = d;
+          for (size_t i = 0; i < pos.size(); ++i) {
+            perfect_[pos[i]] = bucket[b][i];
+          }
+          break;
+        }
+      }
+    }
+    frozen_ = true;
+    num_frozen_ = size_;
+    return true;
+  }
+
+  size_t Bytes() const {
+    return arena_.size() + id_offset_.size() * sizeof(uint64_t)
+           + id_hash_.size() * sizeof(uint64_t) + slot_.size() * sizeof(Slot)
+           + disp_.size() * sizeof(uint32_t) + perfect_.size() * sizeof(int);
+  }
+
+  size_t bucket_of(uint64_t h) const {
+    return h % disp_.size();
+  }
+
+  size_t perfect_pos(uint64_t h, uint32_t d) const {
+    return mix(h ^ (d * 0x9e3779b97f4a7c15ULL)) % perfect_.size();
+  }
+
+  // Id of a frozen word, -1 if not frozen or not among them
+  int find_frozen(std::string_view word, uint64_t h) const {
+    if (!frozen_) {
+      return -1;
+    }
+    int id = perfect_[perfect_pos(h, disp_[bucket_of(h)])];
+    return (id != -1 and GetWord(id) == word) ? id : -1;
+  }
+
+  // Slot holding word, or the empty slot where it would go
+  size_t find(std::string_view word, uint64_t h) const {
+    if (slot_.empty()) {
+      return 0;
+    }
+    size_t mask = slot_.size() - 1;
+    uint32_t tag = h >> 32;
+    for (size_t pos = h & mask; ; pos = (pos + 1) & mask) {
+      const Slot& s = slot_[pos];
+      if (s.id_ == -1 or (s.tag_ == tag and GetWord(s.id_) == word)) {
+        return pos;
+      }
+    }
+  }
+
+  void rehash(size_t num_slot) {
+    slot_.assign(num_slot, {0, -1});
+    size_t mask = num_slot - 1;
+    for (int id = 0; id < size_; ++id) {
+      uint64_t h = id_hash_[id];
+      size_t pos = h & mask;
+      while (slot_[pos].id_ != -1) {
+        pos = (pos + 1) & mask;
+      }
+      slot_[pos] = {(uint32_t)(h >> 32), id};
+    }
   }
 };
 
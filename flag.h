@@ -129,7 +129,7 @@ struct Flag {
 };
 
 struct StrComp {
-  bool operator() (const char *s1, const char *s2) {
+  bool operator() (const char *s1, const char *s2) const {
     return (strcmp(s1, s2) < 0);
   }
 };
@@ -0,0 +1,92 @@
+// F+tree: a complete binary sum tree over n nonnegative weights.
+//
+// Usage:
+//   FTree tree;
+//   tree.Build(weight, n);           // O(n)
+//   tree.Set(k, w);                  // O(log n)
+//   int k = tree.Sample(u * tree.Sum()); // O(log n)
+//
+// Note:
+// - Every update recomputes the sums on the path to the root from the
+//   children, so Sum() is exact up to one rounding per level and does not
+//   drift over many updates.
+// - Set<N>() and Sample<N>() take the leaf count as a template argument when
+//   it is known at compile time, so their loops over the levels unroll.
+#pragma once
+
+#include "util.h"
+
+#include <vector>
+
+struct FTree {
+  int size_ = 0; // number of leaves, rounded up to a power of two
+  std::vector<real> node_; // node_[1] is the root, leaves start at size_
+
+  void Build(const real *weight, int n) {
+    size_ = 1;
+    while (size_ < n) {
+      size_ <<= 1;
+    }
+    node_.assign(2 * size_, 0.0);
+    for (int i = 0; i < n; ++i) {
+      node_[size_ + i] = weight[i];
+    }
+    for (int j = size_ - 1; j > 0; --j) {
+      node_[j] = node_[2*j] + node_[2*j+1];
+    }
+  }
+
+  static constexpr int log2_of(int n) {
+    return (n <= 1) ? 0 : 1 + log2_of(n >> 1);
+  }
+
+  template <int N = 0> // N is size_ if known at compile time
+  void Set(int i, real weight) {
+    real *node = node_.data();
+    int j = (N ? N : size_) + i;
+    node[j] = weight;
+    if constexpr (N > 0) {
+      for (int level = 0; level < log2_of(N); ++level) {
+        j >>= 1;
+        node[j] = node[2*j] + node[2*j+1];
+      }
+    } else {
+      for (j >>= 1; j > 0; j >>= 1) {
+        node[j] = node[2*j] + node[2*j+1];
+      }
+    }
+  }
+
+  real Get(int i) const {
+    return node_[size_ + i];
+  }
+
+  real Sum() const {
+    return node_[1];
+  }
+
+  template <int N = 0>
+  int Sample(real u) const { // u is uniform in [0, Sum())
+    const real *node = node_.data();
+    auto step = [node, &u](int j) { // child of j that holds u
+      real left = node[2*j];
+      if (u < left or node[2*j+1] == 0.0) { // never walk into empty leaves
+        return 2*j;
+      }
+      u -= left;
+      return 2*j+1;
+    };
+    int j = 1;
+    if constexpr (N > 0) {
+      for (int level = 0; level < log2_of(N); ++level) {
+        j = step(j);
+      }
+      return j - N;
+    } else {
+      while (j < size_) {
+        j = step(j);
+      }
+      return j - size_;
+    }
+  }
+};
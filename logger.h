@@ -13,6 +13,7 @@
 // - Header only contains datetime.
 // - Appends '\n'.
 // - Message should be less than MAX_LOG_SIZE bytes, otherwise undefined
+// - Thread safe, lines of different threads do not interleave.
 #pragma once
 
 #include <time.h>
@@ -21,11 +22,13 @@
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
+#include <mutex>
 
 #define MAX_LOG_SIZE 1024
 
 struct Logger {
   char buf_[MAX_LOG_SIZE];
+  std::mutex mutex_; // lines may come from several threads
 
   static Logger& instance() { // singleton
     static Logger e;
@@ -48,8 +51,10 @@ struct Logger {
   }
 
   void Format(int fd, const char *fmt, va_list ap) {
+    std::lock_guard<std::mutex> guard(mutex_);
     time_t time_since_epoch = time(NULL);
-    struct tm* tm_info = localtime(&time_since_epoch);
+    struct tm tm_buf;
+    struct tm* tm_info = localtime_r(&time_since_epoch, &tm_buf);
     if (tm_info == NULL) {
       perror("localtime");
       exit(EXIT_FAILURE);
@@ -0,0 +1,42 @@
+// Hot path counters of the samplers, summed per iteration and written to
+// -metrics_file. They cost an add or two per token, so they are compiled in
+// only with -DMETRICS (make METRICS=1), otherwise METRIC() expands to nothing.
+//
+// Usage:
+//   SamplerMetrics m;
+//   METRIC(++m.token_);
+//   METRIC(m.row_size_max_ = std::max(m.row_size_max_, n));
+#pragma once
+
+#include <algorithm>
+
+#ifdef METRICS
+#define METRIC(stmt) do { stmt; } while (0)
+#else
+#define METRIC(stmt) do {} while (0)
+#endif
+
+struct SamplerMetrics {
+  long long token_ = 0; // tokens sampled
+  long long changed_ = 0; // tokens that moved to another topic
+  long long draw_r_ = 0, draw_s_ = 0, draw_t_ = 0; // SparseLDA bucket hits
+  long long mh_propose_ = 0, mh_accept_ = 0; // alias sampler MH steps
+  long long row_size_sum_ = 0; // nonzero topics of the nkw rows visited
+  long long row_size_max_ = 0;
+  long long doc_ = 0; // documents sampled
+  long long doc_topic_sum_ = 0; // nonzero topics of those documents
+
+  void Add(const SamplerMetrics& o) {
+    token_ += o.token_;
+    changed_ += o.changed_;
+    draw_r_ += o.draw_r_;
+    draw_s_ += o.draw_s_;
+    draw_t_ += o.draw_t_;
+    mh_propose_ += o.mh_propose_;
+    mh_accept_ += o.mh_accept_;
+    row_size_sum_ += o.row_size_sum_;
+    row_size_max_ = std::max(row_size_max_, o.row_size_max_);
+    doc_ += o.doc_;
+    doc_topic_sum_ += o.doc_topic_sum_;
+  }
+};
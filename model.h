@@ -0,0 +1,135 @@
+// Binary model checkpoint. Every section starts at an 8-byte boundary:
+//   ModelHeader
+//   float    alpha[num_topic]
+//   int32_t  nk[num_topic]
+//   int64_t  row_offset[num_word + 1], into the pairs
+//   CountPair pair[num_pair], (topic, count) of every nkw row
+//   uint64_t word_offset[num_word + 1], into the word bytes
+//   char     word[word_bytes], vocabulary in word id order
+// followed, if MODEL_HAS_ASSIGNMENT is set, by the training corpus:
+//   int32_t  doc_offset[num_doc + 1]
+//   uintW_t  token[num_token], W = 8 * tok_width
+//   uintW_t  assignment[num_token], W = 8 * asg_width
+//
+// ModelView maps a checkpoint read-only and points into it, so consumers can
+// use a model of any size without deserializing or copying it.
+#pragma once
+
+#include "reader.h"
+#include "writer.h"
+#include "sparse_count.h"
+#include "narrow_array.h"
+
+#include <memory>
+#include <algorithm>
+#include <string_view>
+
+const char MODEL_MAGIC[8] = "LDAMODL";
+const uint32_t MODEL_VERSION = 1;
+const uint32_t MODEL_HAS_ASSIGNMENT = 1;
+
+struct ModelHeader {
+  char magic_[8];
+  uint32_t version_, flags_;
+  int64_t num_topic_, num_word_, num_pair_, word_bytes_;
+  int64_t num_doc_, num_token_;
+  uint32_t tok_width_, asg_width_;
+  float beta_, beta_sum_;
+  int32_t num_iter_; // sweeps done so far
+  int32_t padding_;
+};
+
+struct ModelView {
+  std::shared_ptr<Reader> file_;
+  ModelHeader header_;
+  const float *alpha_;
+  const int32_t *nk_;
+  const int64_t *row_offset_;
+  const SparseCount::CountPair *pair_;
+  const uint64_t *word_offset_;
+  const char *word_;
+  const int32_t *doc_offset_; // NULL without assignments
+  NarrowArray tok_, asg_; // views
+
+  bool Open(const char *model_file) {
+    if (access(model_file, R_OK) != 0) {
+      return false;
+    }
+    file_ = std::make_shared<Reader>(model_file);
+    if (file_->size_ < sizeof(ModelHeader)) {
+      return false;
+    }
+    memcpy(&header_, file_->data_, sizeof(header_));
+    const auto& h = header_;
+    if (memcmp(h.magic_, MODEL_MAGIC, sizeof(h.magic_)) != 0
+        or h.version_ != MODEL_VERSION) {
+      return false;
+    }
+    auto width_ok = [](uint32_t w) { return w == 1 or w == 2 or w == 4; };
+    bool has_asg = h.flags_ & MODEL_HAS_ASSIGNMENT;
+    if (h.num_topic_ <= 0 or h.num_word_ < 0 or h.num_pair_ < 0 or h.word_bytes_ < 0
+        or (has_asg and (h.num_doc_ < 0 or h.num_token_ < 0
+                         or !width_ok(h.tok_width_) or !width_ok(h.asg_width_)))) {
+      return false;
+    }
+    int64_t size = file_->size_, pos = Writer::Align8(sizeof(h));
+    auto take = [&](int64_t n, int64_t width) -> const char* { // NULL past the end
+      if (pos < 0 or n > (size - pos) / width) {
+        pos = -1;
+        return NULL;
+      }
+      const char *q = file_->data_ + pos;
+      pos = std::min<int64_t>(size, pos + Writer::Align8(n * width));
+      return q;
+    };
+    alpha_ = reinterpret_cast<const float*>(take(h.num_topic_, sizeof(float)));
+    nk_ = reinterpret_cast<const int32_t*>(take(h.num_topic_, sizeof(int32_t)));
+    row_offset_ = reinterpret_cast<const int64_t*>(take(h.num_word_ + 1, sizeof(int64_t)));
+    pair_ = reinterpret_cast<const SparseCount::CountPair*>(
+              take(h.num_pair_, sizeof(SparseCount::CountPair)));
+    word_offset_ = reinterpret_cast<const uint64_t*>(take(h.num_word_ + 1, sizeof(uint64_t)));
+    word_ = take(h.word_bytes_, 1);
+    doc_offset_ = NULL;
+    const char *tok = NULL, *asg = NULL;
+    if (has_asg) {
+      doc_offset_ = reinterpret_cast<const int32_t*>(take(h.num_doc_ + 1, sizeof(int32_t)));
+      tok = take(h.num_token_, h.tok_width_);
+      asg = take(h.num_token_, h.asg_width_);
+    }
+    if (pos < 0) {
+      return false;
+    }
+
+    // Offsets start at 0, never decrease and end at their section size
+    auto monotone = [](const auto *offset, int64_t n, int64_t last) {
+      if (offset[0] != 0 or (int64_t)offset[n] != last) {
+        return false;
+      }
+      for (int64_t i = 0; i < n; ++i) {
+        if (offset[i] > offset[i + 1]) {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (!monotone(row_offset_, h.num_word_, h.num_pair_)
+        or !monotone(word_offset_, h.num_word_, h.word_bytes_)) {
+      return false;
+    }
+    if (has_asg) {
+      if (!monotone(doc_offset_, h.num_doc_, h.num_token_)) {
+        return false;
+      }
+      tok_.View(tok, h.num_token_, h.tok_width_);
+      asg_.View(asg, h.num_token_, h.asg_width_);
+    }
+    return true;
+  }
+
+  std::string_view Word(int w) const {
+    return std::string_view(word_ + word_offset_[w], word_offset_[w + 1] - word_offset_[w]);
+  }
+
+  const SparseCount::CountPair* RowBegin(int w) const { return pair_ + row_offset_[w]; }
+  const SparseCount::CountPair* RowEnd(int w) const { return pair_ + row_offset_[w + 1]; }
+};
@@ -0,0 +1,92 @@
+// Flat array of nonnegative integers stored in the narrowest unsigned type
+// (1, 2 or 4 bytes) that holds the largest value it is initialized for.
+//
+// Usage:
+//   NarrowArray asg;
+//   asg.Init(num_token, num_topic - 1); // uint8_t for K <= 256, etc.
+//   asg.Set(i, k);
+//   int k = asg[i];
+//
+// Note:
+// - The width is a runtime property, every access switches on it. The branch
+//   is perfectly predictable in loops. Kernels specialized on the width use
+//   Typed<T>() instead, with sizeof(T) == width_.
+// - View() wraps external memory, e.g. a read-only mapping, without a copy.
+//   Views must not be Set().
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+struct NarrowArray {
+  int width_ = 1; // bytes per element
+  size_t size_ = 0;
+  std::vector<uint8_t> buf_;
+  const uint8_t *view_ = NULL; // external storage, used instead of buf_
+
+  static int WidthFor(long long max_value) {
+    return (max_value <= UINT8_MAX) ? 1 : (max_value <= UINT16_MAX) ? 2 : 4;
+  }
+
+  void Init(size_t size, long long max_value) {
+    width_ = WidthFor(max_value);
+    size_ = size;
+    buf_.assign(size * width_, 0);
+    view_ = NULL;
+  }
+
+  void Assign(const std::vector<int>& value, long long max_value) {
+    Init(value.size(), max_value);
+    for (size_t i = 0; i < value.size(); ++i) {
+      Set(i, value[i]);
+    }
+  }
+
+  void View(const void *data, size_t size, int width) {
+    width_ = width;
+    size_ = size;
+    buf_.clear();
+    buf_.shrink_to_fit();
+    view_ = static_cast<const uint8_t*>(data);
+  }
+
+  const uint8_t* data() const {
+    return view_ ? view_ : buf_.data();
+  }
+
+  template <typename T>
+  const T* Typed() const {
+    return reinterpret_cast<const T*>(data());
+  }
+
+  template <typename T>
+  T* Typed() { // owned storage only
+    return reinterpret_cast<T*>(buf_.data());
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  size_t Bytes() const { // resident in this process, views are not counted
+    return buf_.size();
+  }
+
+  int operator[](size_t i) const {
+    const uint8_t *p = data();
+    switch (width_) {
+      case 1:  return p[i];
+      case 2:  return reinterpret_cast<const uint16_t*>(p)[i];
+      default: return reinterpret_cast<const uint32_t*>(p)[i];
+    }
+  }
+
+  void Set(size_t i, int value) {
+    switch (width_) {
+      case 1:  buf_[i] = value; break;
+      case 2:  reinterpret_cast<uint16_t*>(buf_.data())[i] = value; break;
+      default: reinterpret_cast<uint32_t*>(buf_.data())[i] = value; break;
+    }
+  }
+};
@@ -1,33 +1,74 @@
+// Memory-mapped file reader. Every line is a record.
+//
+// Usage:
+//   Reader reader("data.libsvm");
+//   for (const auto& chunk : reader.Split(num_thread)) {
+//     ... // parse lines in [chunk.begin_, chunk.end_) in parallel
+//   }
+//
+// Note:
+// - Chunks are line aligned, each one starts at the beginning of a line and
+//   ends right after a '\n' or at the end of the file.
 #pragma once
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <functional>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
 
-// Buffered file reader. Every line is a record.
 struct Reader {
-  FILE *fp_;
+  struct Chunk {
+    const char *begin_, *end_;
+  };
 
-  Reader(const char* filename) {
-    fp_ = fopen(filename, "r");
-    if (fp_ == NULL) {
+  int fd_;
+  const char *data_;
+  size_t size_;
+
+  Reader(const char* filename) : data_(NULL), size_(0) {
+    fd_ = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 or fstat(fd_, &st) != 0) {
       fprintf(stderr, "Open failed: %s\n", filename);
       exit(EXIT_FAILURE);
     }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void *addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (addr == MAP_FAILED) {
+        fprintf(stderr, "Mmap failed: %s\n", filename);
+        exit(EXIT_FAILURE);
+      }
+      madvise(addr, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(addr);
+    }
   }
 
   ~Reader() {
-    fclose(fp_);
+    if (data_ != NULL) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+    close(fd_);
   }
 
-  int Read(std::function<int(char*)> line_parser) {
-    char *line = NULL;
-    size_t num_byte;
-    int sum = 0;
-    while (getline(&line, &num_byte, fp_) != -1) {
-      sum += line_parser(line);
+  std::vector<Chunk> Split(int num_chunk) const { // roughly equal in bytes
+    std::vector<Chunk> chunk;
+    const char *end = data_ + size_;
+    const char *begin = data_;
+    for (int i = 1; i <= num_chunk and begin < end; ++i) {
+      const char *cut = data_ + size_ * i / num_chunk;
+      if (cut < begin) {
+        cut = begin;
+      }
+      const char *eol = (cut < end) ? (const char*)memchr(cut, '\n', end - cut) : NULL;
+      cut = (eol == NULL or i == num_chunk) ? end : eol + 1;
+      chunk.push_back({begin, cut});
+      begin = cut;
     }
-    free(line);
-    return sum;
+    return chunk;
   }
 };
@@ -0,0 +1,182 @@
+// Philox4x32-10 counter-based random numbers (Salmon et al., Parallel random
+// numbers: as easy as 1, 2, 3, SC 2011). Output block i of a stream is a
+// pure function of (key, stream, i), so streams need no shared state and a
+// draw does not depend on which thread makes it or when.
+//
+// Usage:
+//   Philox rng(seed, stream); // e.g. stream = sweep << 32 | doc
+//   rng.Fill(u, n);           // next n uniforms in [0, 1)
+//
+// Note:
+// - Fill() generates whole blocks of 4 numbers, SSE2/AVX2 lanes compute
+//   several blocks at once. The tail of the last block is discarded, so the
+//   next Fill() starts at a fresh block.
+// - Uniforms have 24 random bits, so they are exact floats below 1.
+#pragma once
+
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+struct Philox {
+  static const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57; // round multipliers
+  static const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85; // key schedule
+  static const int ROUNDS = 10;
+
+  uint32_t key_[2];
+  uint32_t ctr_[4]; // block index in ctr_[0..1], stream in ctr_[2..3]
+
+  Philox(uint64_t key, uint64_t stream)
+    : key_{(uint32_t)key, (uint32_t)(key >> 32)},
+      ctr_{0, 0, (uint32_t)stream, (uint32_t)(stream >> 32)} {}
+
+  // One block, out = Philox(key, ctr)
+  static void Block(const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4]) {
+    uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    for (int r = 0; r < ROUNDS; ++r) {
+      uint64_t p0 = (uint64_t)M0 * c0;
+      uint64_t p1 = (uint64_t)M1 * c2;
+      uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+      uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+      c1 = (uint32_t)p1;
+      c3 = (uint32_t)p0;
+      c0 = n0;
+      c2 = n2;
+      k0 += W0;
+      k1 += W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+  }
+
+  static float to_unit(uint32_t x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+  }
+
+  void next_block(float *out) {
+    uint32_t x[4];
+    Block(key_, ctr_, x);
+    for (int j = 0; j < 4; ++j) {
+      out[j] = to_unit(x[j]);
+    }
+    if (++ctr_[0] == 0) {
+      ++ctr_[1];
+    }
+  }
+
+  void Fill(float *out, int n) {
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= n and ctr_[0] <= UINT32_MAX - 8; i += 32) {
+      fill8(out + i);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n and ctr_[0] <= UINT32_MAX - 4; i += 16) {
+      fill4(out + i);
+    }
+#endif
+    for (; i < n; i += 4) {
+      float tail[4];
+      next_block(tail);
+      for (int j = 0; j < 4 and i + j < n; ++j) {
+        out[i + j] = tail[j];
+      }
+    }
+  }
+
+#if defined(__SSE2__)
+  // Lanes hold the same word of consecutive blocks
+  static void mulhilo4(__m128i x, __m128i m, __m128i *hi, __m128i *lo) {
+    __m128i even = _mm_mul_epu32(x, m); // lanes 0 and 2
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), m); // lanes 1 and 3
+    __m128i low_mask = _mm_set_epi32(0, -1, 0, -1);
+    *lo = _mm_or_si128(_mm_and_si128(even, low_mask), _mm_slli_epi64(odd, 32));
+    *hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low_mask, odd));
+  }
+
+  static __m128 to_unit4(__m128i x) {
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+  }
+
+  void fill4(float *out) { // blocks ctr_[0] .. ctr_[0] + 3
+    __m128i c0 = _mm_add_epi32(_mm_set1_epi32(ctr_[0]), _mm_set_epi32(3, 2, 1, 0));
+    __m128i c1 = _mm_set1_epi32(ctr_[1]);
+    __m128i c2 = _mm_set1_epi32(ctr_[2]);
+    __m128i c3 = _mm_set1_epi32(ctr_[3]);
+    __m128i m0 = _mm_set1_epi32(M0), m1 = _mm_set1_epi32(M1);
+    uint32_t k0 = key_[0], k1 = key_[1];
+    for (int r = 0; r < ROUNDS; ++r) {
+      __m128i hi0, lo0, hi1, lo1;
+      mulhilo4(c0, m0, &hi0, &lo0);
+      mulhilo4(c2, m1, &hi1, &lo1);
+      c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), _mm_set1_epi32(k0));
+      c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), _mm_set1_epi32(k1));
+      c1 = lo1;
+      c3 = lo0;
+      k0 += W0;
+      k1 += W1;
+    }
+    __m128 f0 = to_unit4(c0), f1 = to_unit4(c1), f2 = to_unit4(c2), f3 = to_unit4(c3);
+    _MM_TRANSPOSE4_PS(f0, f1, f2, f3); // to block order
+    _mm_storeu_ps(out, f0);
+    _mm_storeu_ps(out + 4, f1);
+    _mm_storeu_ps(out + 8, f2);
+    _mm_storeu_ps(out + 12, f3);
+    ctr_[0] += 4;
+  }
+#endif
+
+#if defined(__AVX2__)
+  static void mulhilo8(__m256i x, __m256i m, __m256i *hi, __m256i *lo) {
+    __m256i even = _mm256_mul_epu32(x, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+    __m256i low_mask = _mm256_set1_epi64x(0xffffffffLL);
+    *lo = _mm256_or_si256(_mm256_and_si256(even, low_mask), _mm256_slli_epi64(odd, 32));
+    *hi = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_andnot_si256(low_mask, odd));
+  }
+
+  static __m256 to_unit8(__m256i x) {
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8)),
+                         _mm256_set1_ps(1.0f / 16777216.0f));
+  }
+
+  void fill8(float *out) { // blocks ctr_[0] .. ctr_[0] + 7
+    __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32(ctr_[0]), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i c1 = _mm256_set1_epi32(ctr_[1]);
+    __m256i c2 = _mm256_set1_epi32(ctr_[2]);
+    __m256i c3 = _mm256_set1_epi32(ctr_[3]);
+    __m256i m0 = _mm256_set1_epi32(M0), m1 = _mm256_set1_epi32(M1);
+    uint32_t k0 = key_[0], k1 = key_[1];
+    for (int r = 0; r < ROUNDS; ++r) {
+      __m256i hi0, lo0, hi1, lo1;
+      mulhilo8(c0, m0, &hi0, &lo0);
+      mulhilo8(c2, m1, &hi1, &lo1);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+      c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+      c1 = lo1;
+      c3 = lo0;
+      k0 += W0;
+      k1 += W1;
+    }
+    __m256 f[4] = {to_unit8(c0), to_unit8(c1), to_unit8(c2), to_unit8(c3)};
+    for (int half = 0; half < 2; ++half) { // blocks 0-3, then 4-7
+      __m128 g0 = half ? _mm256_extractf128_ps(f[0], 1) : _mm256_castps256_ps128(f[0]);
+      __m128 g1 = half ? _mm256_extractf128_ps(f[1], 1) : _mm256_castps256_ps128(f[1]);
+      __m128 g2 = half ? _mm256_extractf128_ps(f[2], 1) : _mm256_castps256_ps128(f[2]);
+      __m128 g3 = half ? _mm256_extractf128_ps(f[3], 1) : _mm256_castps256_ps128(f[3]);
+      _MM_TRANSPOSE4_PS(g0, g1, g2, g3);
+      float *o = out + 16 * half;
+      _mm_storeu_ps(o, g0);
+      _mm_storeu_ps(o + 4, g1);
+      _mm_storeu_ps(o + 8, g2);
+      _mm_storeu_ps(o + 12, g3);
+    }
+    ctr_[0] += 8;
+  }
+#endif
+};
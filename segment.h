@@ -0,0 +1,206 @@
+// On-disk corpus for out-of-core training. Every section starts at an
+// 8-byte boundary:
+//   SegmentHeader
+//   uint32_t token[num_token], global word ids
+//   int64_t  offset[num_doc + 1]
+//   uintW_t  assignment[num_token], W = 8 * asg_width
+//
+// Usage:
+//   SegmentFile segment;
+//   segment.Build("train.libsvm", "train.seg", num_topic, batch_token);
+//   for (int b = 0; b < segment.NumBatch(); ++b) {
+//     segment.Read(b, &corpus); // documents of minibatch b
+//     ...
+//     segment.WriteAssignment(b, corpus);
+//   }
+//
+// Note:
+// - Minibatches are runs of whole documents with about batch_token tokens,
+//   only their boundaries stay in memory.
+// - Read() and WriteAssignment() of different minibatches may run
+//   concurrently, e.g. to prefetch the next one while sampling the current.
+#pragma once
+
+#include "dict.h"
+#include "timer.h"
+#include "logger.h"
+#include "reader.h"
+#include "writer.h"
+#include "corpus.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct SegmentHeader {
+  char magic_[8];
+  uint32_t version_, asg_width_;
+  int64_t num_doc_, num_token_;
+};
+
+const char SEGMENT_MAGIC[8] = "LDASEGM";
+const uint32_t SEGMENT_VERSION = 1;
+const size_t SEGMENT_PARSE_BYTES = 64 << 20; // text parsed per step
+
+struct SegmentFile {
+  int fd_ = -1;
+  std::string file_;
+  SegmentHeader header_;
+  int64_t token_pos_, offset_pos_, asg_pos_; // section offsets in bytes
+  std::vector<int64_t> batch_doc_, batch_token_; // num_batch + 1, boundaries
+  int64_t max_word_count_ = 0; // occurrences of the most frequent word
+
+  ~SegmentFile() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  int NumBatch() const {
+    return (int)batch_doc_.size() - 1;
+  }
+
+  size_t Bytes() const { // the whole file, tokens, offsets and assignments
+    return asg_pos_ + header_.num_token_ * header_.asg_width_;
+  }
+
+  // Parse a LIBSVM file into a new segment file, SEGMENT_PARSE_BYTES of text
+  // at a time, so memory does not grow with the corpus. Assignments are
+  // left zero.
+  void Build(const char *data_file, const char *segment_file, int num_topic,
+             int64_t batch_token) {
+    Timer build_timer("Build segment");
+    file_ = segment_file;
+    fd_ = open(segment_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    FILE *offset_fp = tmpfile(); // offsets go after the tokens
+    if (fd_ < 0 or offset_fp == NULL) {
+      lg.Fatalf("cannot create segment file %s", segment_file);
+    }
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic_, SEGMENT_MAGIC, sizeof(header_.magic_));
+    header_.version_ = SEGMENT_VERSION;
+    header_.asg_width_ = NarrowArray::WidthFor(num_topic - 1);
+    token_pos_ = Writer::Align8(sizeof(header_));
+
+    Reader reader(data_file);
+    std::vector<int64_t> freq;
+    std::vector<uint32_t> token;
+    int64_t num_doc = 0, num_token = 0, offset = 0;
+    batch_doc_.assign(1, 0);
+    batch_token_.assign(1, 0);
+    put_offset(offset_fp, offset);
+    for (const auto& chunk : reader.Split(std::max<size_t>(1, reader.size_ / SEGMENT_PARSE_BYTES))) {
+      ParsedChunk pc;
+      pc.Parse(chunk.begin_, chunk.end_);
+      pc.global_.resize(pc.word_.size());
+      for (size_t i = 0; i < pc.word_.size(); ++i) {
+        pc.global_[i] = dict.InsertWord(pc.word_[i]);
+      }
+      freq.resize(dict.size_, 0);
+      token.resize(pc.tok_.size());
+      for (size_t j = 0; j < pc.tok_.size(); ++j) {
+        token[j] = pc.global_[pc.tok_[j]];
+        max_word_count_ = std::max(max_word_count_, ++freq[token[j]]);
+      }
+      write_at(token.data(), token.size() * sizeof(uint32_t),
+               token_pos_ + num_token * sizeof(uint32_t));
+      num_token += token.size();
+      for (int len : pc.length_) {
+        offset += len;
+        put_offset(offset_fp, offset);
+        ++num_doc;
+        if (offset - batch_token_.back() >= batch_token) {
+          batch_doc_.push_back(num_doc);
+          batch_token_.push_back(offset);
+        }
+      }
+    }
+    if (batch_doc_.back() != num_doc or num_doc == 0) {
+      batch_doc_.push_back(num_doc);
+      batch_token_.push_back(offset);
+    }
+    header_.num_doc_ = num_doc;
+    header_.num_token_ = num_token;
+
+    // Copy offsets behind the tokens, then extend the file for assignments
+    offset_pos_ = token_pos_ + Writer::Align8(num_token * sizeof(uint32_t));
+    asg_pos_ = offset_pos_ + Writer::Align8((num_doc + 1) * sizeof(int64_t));
+    rewind(offset_fp);
+    std::vector<int64_t> buf(1 << 16);
+    int64_t pos = offset_pos_;
+    size_t n;
+    while ((n = fread(buf.data(), sizeof(int64_t), buf.size(), offset_fp)) > 0) {
+      write_at(buf.data(), n * sizeof(int64_t), pos);
+      pos += n * sizeof(int64_t);
+    }
+    fclose(offset_fp);
+    write_at(&header_, sizeof(header_), 0);
+    if (ftruncate(fd_, asg_pos_ + num_token * header_.asg_width_) != 0) {
+      lg.Fatalf("cannot extend segment file %s", segment_file);
+    }
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    lg.Printf("doc = %lld, token = %lld, word = %d, %d minibatches in %s",
+              (long long)num_doc, (long long)num_token, dict.size_, NumBatch(), segment_file);
+  }
+
+  // Load the documents and assignments of minibatch b, offsets are local
+  void Read(int b, Corpus *corpus) const {
+    int64_t doc_begin = batch_doc_[b], token_begin = batch_token_[b];
+    int num_doc = batch_doc_[b + 1] - doc_begin;
+    int num_token = batch_token_[b + 1] - token_begin;
+    std::vector<int64_t> offset(num_doc + 1);
+    read_at(offset.data(), offset.size() * sizeof(int64_t),
+            offset_pos_ + doc_begin * sizeof(int64_t));
+    corpus->offset_.resize(num_doc + 1);
+    for (int d = 0; d <= num_doc; ++d) {
+      corpus->offset_[d] = offset[d] - token_begin;
+    }
+    corpus->num_doc_ = num_doc;
+    corpus->num_token_ = num_token;
+    corpus->tok_.Init(num_token, UINT32_MAX);
+    read_at(corpus->tok_.buf_.data(), corpus->tok_.Bytes(),
+            token_pos_ + token_begin * sizeof(uint32_t));
+    corpus->asg_.Init(num_token, (1LL << (8 * header_.asg_width_)) - 1);
+    read_at(corpus->asg_.buf_.data(), corpus->asg_.Bytes(),
+            asg_pos_ + token_begin * header_.asg_width_);
+  }
+
+  void WriteAssignment(int b, const Corpus& corpus) const {
+    write_at(corpus.asg_.data(), corpus.asg_.Bytes(),
+             asg_pos_ + batch_token_[b] * header_.asg_width_);
+  }
+
+  static void put_offset(FILE *fp, int64_t offset) {
+    if (fwrite(&offset, sizeof(offset), 1, fp) != 1) {
+      lg.Fatalf("cannot write segment offsets");
+    }
+  }
+
+  void read_at(void *data, size_t size, int64_t pos) const {
+    char *p = static_cast<char*>(data);
+    while (size > 0) {
+      ssize_t n = pread(fd_, p, size, pos);
+      if (n <= 0) {
+        lg.Fatalf("cannot read segment file %s", file_.c_str());
+      }
+      p += n;
+      size -= n;
+      pos += n;
+    }
+  }
+
+  void write_at(const void *data, size_t size, int64_t pos) const {
+    const char *p = static_cast<const char*>(data);
+    while (size > 0) {
+      ssize_t n = pwrite(fd_, p, size, pos);
+      if (n <= 0) {
+        lg.Fatalf("cannot write segment file %s", file_.c_str());
+      }
+      p += n;
+      size -= n;
+      pos += n;
+    }
+  }
+};
@@ -0,0 +1,304 @@
+// Vector kernels over packed nkw rows (see SparseCount for the entry
+// layout) with dispatch on the CPU at run time. The binary targets the
+// baseline ISA, the AVX2 and AVX-512 versions are compiled with target
+// attributes and picked by Simd::Init(), so one build runs everywhere.
+//
+// Usage:
+//   Simd::Init("auto"); // or avx512, avx2, scalar, false if unsupported
+//   sum = Simd::PrefixSum(entry, n, shift, coeff, skip, sum, out);
+//   int i = Simd::LowerBound(out, n, u); // first out[i] >= u
+//   s = Simd::Dot(nkw.Row(w), coeff, s); // s + sum of coeff[k] * cnt
+//
+// Note:
+// - Vectors add their lanes in a tree, so sums differ from the scalar loops
+//   in the last bits. -simd scalar reproduces the sequential sums.
+// - Rows shorter than MIN_ROW stay scalar, the setup costs more than the
+//   vectors save there.
+// - LowerBound() narrows the range by bisection and counts the entries
+//   below u in the last window, the same index as std::lower_bound.
+#pragma once
+
+#include "util.h"
+#include "sparse_count.h"
+
+#include <stdint.h>
+#include <string>
+#include <algorithm>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_AVX2 __attribute__((target("avx2,popcnt")))
+#define SIMD_AVX512 __attribute__((target("avx512f,popcnt")))
+#endif
+
+enum SimdLevel { SIMD_LEVEL_SCALAR, SIMD_LEVEL_AVX2, SIMD_LEVEL_AVX512 };
+
+struct Simd {
+  static inline SimdLevel level_ = SIMD_LEVEL_SCALAR;
+  static const int MIN_ROW = 16;
+  static const int WINDOW = 32; // LowerBound() counts in this many entries
+
+  static bool Init(const std::string& name) {
+    bool avx2 = false, avx512 = false;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2") and __builtin_cpu_supports("popcnt");
+    avx512 = avx2 and __builtin_cpu_supports("avx512f");
+#endif
+    if (name == "auto") {
+      level_ = avx512 ? SIMD_LEVEL_AVX512 : avx2 ? SIMD_LEVEL_AVX2 : SIMD_LEVEL_SCALAR;
+    } else if (name == "avx512" and avx512) {
+      level_ = SIMD_LEVEL_AVX512;
+    } else if (name == "avx2" and avx2) {
+      level_ = SIMD_LEVEL_AVX2;
+    } else if (name == "scalar") {
+      level_ = SIMD_LEVEL_SCALAR;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  static const char* Name() {
+    return (level_ == SIMD_LEVEL_AVX512) ? "avx512" : (level_ == SIMD_LEVEL_AVX2) ? "avx2" : "scalar";
+  }
+
+  // out[i] = sum + the first i + 1 terms coeff[k] * (cnt - (k == skip)),
+  // returns the total. Pass skip = -1 to take the counts as they are.
+  template <typename Entry>
+  static real PrefixSum(const Entry *entry, int n, int shift, const real *coeff,
+                        int skip, real sum, real *out) {
+    int i = 0;
+#if defined(__x86_64__)
+    if (n >= MIN_ROW and level_ == SIMD_LEVEL_AVX512) {
+      i = prefix_sum_avx512(entry, n, shift, coeff, skip, &sum, out);
+    } else if (n >= MIN_ROW and level_ == SIMD_LEVEL_AVX2) {
+      i = prefix_sum_avx2(entry, n, shift, coeff, skip, &sum, out);
+    }
+#endif
+    const Entry mask = ((Entry)1 << shift) - 1;
+    for (; i < n; ++i) {
+      int k = entry[i] & mask;
+      int nkw_val = (int)(entry[i] >> shift) - (k == skip);
+      sum += coeff[k] * nkw_val;
+      out[i] = sum;
+    }
+    return sum;
+  }
+
+  static real PrefixSum(const SparseCount::RowView& row, const real *coeff,
+                        int skip, real sum, real *out) {
+    if (row.width_ == 4) {
+      return PrefixSum(reinterpret_cast<const uint32_t*>(row.data_), row.size_, row.shift_,
+                       coeff, skip, sum, out);
+    }
+    return PrefixSum(reinterpret_cast<const uint64_t*>(row.data_), row.size_, row.shift_,
+                     coeff, skip, sum, out);
+  }
+
+  // sum + the terms coeff[k] * cnt of one row
+  template <typename Entry>
+  static real Dot(const Entry *entry, int n, int shift, const real *coeff, real sum) {
+    int i = 0;
+#if defined(__x86_64__)
+    if (n >= MIN_ROW and level_ == SIMD_LEVEL_AVX512) {
+      i = dot_avx512(entry, n, shift, coeff, &sum);
+    } else if (n >= MIN_ROW and level_ == SIMD_LEVEL_AVX2) {
+      i = dot_avx2(entry, n, shift, coeff, &sum);
+    }
+#endif
+    const Entry mask = ((Entry)1 << shift) - 1;
+    for (; i < n; ++i) {
+      sum += coeff[entry[i] & mask] * (int)(entry[i] >> shift);
+    }
+    return sum;
+  }
+
+  static real Dot(const SparseCount::RowView& row, const real *coeff, real sum) {
+    if (row.width_ == 4) {
+      return Dot(reinterpret_cast<const uint32_t*>(row.data_), row.size_, row.shift_, coeff, sum);
+    }
+    return Dot(reinterpret_cast<const uint64_t*>(row.data_), row.size_, row.shift_, coeff, sum);
+  }
+
+  // First i with head[i] >= u in a nondecreasing array, n if none
+  static int LowerBound(const real *head, int n, real u) {
+#if defined(__x86_64__)
+    if (n >= MIN_ROW and level_ != SIMD_LEVEL_SCALAR) {
+      const real *base = head;
+      int len = n;
+      while (len > WINDOW) { // branch free, all of [head, base) is below u
+        int half = len / 2;
+        base = (base[half - 1] < u) ? base + half : base;
+        len -= half;
+      }
+      return (base - head) + ((level_ == SIMD_LEVEL_AVX512) ? count_below_avx512(base, len, u)
+                                                            : count_below_avx2(base, len, u));
+    }
+#endif
+    return std::lower_bound(head, head + n, u) - head;
+  }
+
+#if defined(__x86_64__)
+  // Topics and counts of 8 entries
+  SIMD_AVX2 static void load8(const uint32_t *entry, __m256i mask, __m128i shift,
+                              __m256i *topic, __m256i *cnt) {
+    __m256i e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entry));
+    *topic = _mm256_and_si256(e, mask);
+    *cnt = _mm256_srl_epi32(e, shift);
+  }
+
+  SIMD_AVX2 static void load8(const uint64_t *entry, __m256i, __m128i,
+                              __m256i *topic, __m256i *cnt) {
+    __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7); // low words, then high
+    __m256i a = _mm256_permutevar8x32_epi32(
+                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entry)), split);
+    __m256i b = _mm256_permutevar8x32_epi32(
+                  _mm256_loadu_si256(reinterpret_cast<const __m256i*>(entry + 4)), split);
+    *topic = _mm256_permute2x128_si256(a, b, 0x20);
+    *cnt = _mm256_permute2x128_si256(a, b, 0x31);
+  }
+
+  SIMD_AVX2 static __m256 scan8(__m256 x) { // inclusive prefix sum of the lanes
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+    __m256 low = _mm256_permute_ps(x, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm256_add_ps(x, _mm256_permute2f128_ps(low, low, 0x08)); // low half into the high
+  }
+
+  template <typename Entry>
+  SIMD_AVX2 static int prefix_sum_avx2(const Entry *entry, int n, int shift, const real *coeff,
+                                       int skip, real *sum, real *out) {
+    __m256i mask = _mm256_set1_epi32((sizeof(Entry) == 4) ? (1u << shift) - 1 : 0);
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m256i skip8 = _mm256_set1_epi32(skip);
+    __m256i last = _mm256_set1_epi32(7);
+    __m256 carry = _mm256_set1_ps(*sum);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i topic, cnt;
+      load8(entry + i, mask, count, &topic, &cnt);
+      cnt = _mm256_add_epi32(cnt, _mm256_cmpeq_epi32(topic, skip8)); // -1 on skip
+      __m256 x = _mm256_mul_ps(_mm256_i32gather_ps(coeff, topic, 4), _mm256_cvtepi32_ps(cnt));
+      x = _mm256_add_ps(scan8(x), carry);
+      _mm256_storeu_ps(out + i, x);
+      carry = _mm256_permutevar8x32_ps(x, last);
+    }
+    *sum = _mm256_cvtss_f32(carry);
+    return i;
+  }
+
+  template <typename Entry>
+  SIMD_AVX2 static int dot_avx2(const Entry *entry, int n, int shift, const real *coeff,
+                                real *sum) {
+    __m256i mask = _mm256_set1_epi32((sizeof(Entry) == 4) ? (1u << shift) - 1 : 0);
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i topic, cnt;
+      load8(entry + i, mask, count, &topic, &cnt);
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_i32gather_ps(coeff, topic, 4),
+                                             _mm256_cvtepi32_ps(cnt)));
+    }
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    *sum += _mm_cvtss_f32(x);
+    return i;
+  }
+
+  SIMD_AVX2 static int count_below_avx2(const real *head, int n, real u) {
+    __m256 u8 = _mm256_set1_ps(u);
+    int below = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256 lt = _mm256_cmp_ps(_mm256_loadu_ps(head + i), u8, _CMP_LT_OQ);
+      below += _mm_popcnt_u32(_mm256_movemask_ps(lt));
+    }
+    for (; i < n; ++i) {
+      below += (head[i] < u);
+    }
+    return below;
+  }
+
+  // Topics and counts of 16 entries. GCC 12 warns about the undefined
+  // vectors inside its own AVX-512 intrinsics, they are not ours
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+  SIMD_AVX512 static void load16(const uint32_t *entry, __m512i mask, __m128i shift,
+                                 __m512i *topic, __m512i *cnt) {
+    __m512i e = _mm512_loadu_si512(entry);
+    *topic = _mm512_and_si512(e, mask);
+    *cnt = _mm512_srl_epi32(e, shift);
+  }
+
+  SIMD_AVX512 static void load16(const uint64_t *entry, __m512i, __m128i,
+                                 __m512i *topic, __m512i *cnt) {
+    __m512i a = _mm512_loadu_si512(entry);
+    __m512i b = _mm512_loadu_si512(entry + 8);
+    __m512i low = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    *topic = _mm512_permutex2var_epi32(a, low, b);
+    *cnt = _mm512_permutex2var_epi32(a, _mm512_add_epi32(low, _mm512_set1_epi32(1)), b);
+  }
+
+  SIMD_AVX512 static __m512 scan16(__m512 x) { // inclusive prefix sum of the lanes
+    __m512i zero = _mm512_setzero_si512();
+    x = _mm512_add_ps(x, _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(x), zero, 15)));
+    x = _mm512_add_ps(x, _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(x), zero, 14)));
+    x = _mm512_add_ps(x, _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(x), zero, 12)));
+    return _mm512_add_ps(x, _mm512_castsi512_ps(_mm512_alignr_epi32(_mm512_castps_si512(x), zero, 8)));
+  }
+
+  template <typename Entry>
+  SIMD_AVX512 static int prefix_sum_avx512(const Entry *entry, int n, int shift, const real *coeff,
+                                           int skip, real *sum, real *out) {
+    __m512i mask = _mm512_set1_epi32((sizeof(Entry) == 4) ? (1u << shift) - 1 : 0);
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m512i skip16 = _mm512_set1_epi32(skip);
+    __m512i last = _mm512_set1_epi32(15);
+    __m512 carry = _mm512_set1_ps(*sum);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m512i topic, cnt;
+      load16(entry + i, mask, count, &topic, &cnt);
+      cnt = _mm512_mask_sub_epi32(cnt, _mm512_cmpeq_epi32_mask(topic, skip16), cnt,
+                                  _mm512_set1_epi32(1));
+      __m512 x = _mm512_mul_ps(_mm512_i32gather_ps(topic, coeff, 4), _mm512_cvtepi32_ps(cnt));
+      x = _mm512_add_ps(scan16(x), carry);
+      _mm512_storeu_ps(out + i, x);
+      carry = _mm512_permutexvar_ps(last, x);
+    }
+    *sum = _mm512_cvtss_f32(carry);
+    return i;
+  }
+
+  template <typename Entry>
+  SIMD_AVX512 static int dot_avx512(const Entry *entry, int n, int shift, const real *coeff,
+                                    real *sum) {
+    __m512i mask = _mm512_set1_epi32((sizeof(Entry) == 4) ? (1u << shift) - 1 : 0);
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m512i topic, cnt;
+      load16(entry + i, mask, count, &topic, &cnt);
+      acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_i32gather_ps(topic, coeff, 4),
+                                             _mm512_cvtepi32_ps(cnt)));
+    }
+    *sum += _mm512_reduce_add_ps(acc);
+    return i;
+  }
+
+  SIMD_AVX512 static int count_below_avx512(const real *head, int n, real u) {
+    __m512 u16 = _mm512_set1_ps(u);
+    int below = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+      below += _mm_popcnt_u32(_mm512_cmp_ps_mask(_mm512_loadu_ps(head + i), u16, _CMP_LT_OQ));
+    }
+    __mmask16 tail = (1u << (n - i)) - 1; // n - i < 16
+    return below + _mm_popcnt_u32(_mm512_mask_cmp_ps_mask(tail, _mm512_maskz_loadu_ps(tail, head + i),
+                                                          u16, _CMP_LT_OQ));
+  }
+#pragma GCC diagnostic pop
+#endif
+};
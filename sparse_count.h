@@ -1,103 +1,541 @@
+// Sparse topic counts of every word. Each row is a list of (topic, count)
+// pairs sorted by count in descending order.
+//
+// Usage:
+//   SparseCount nkw;
+//   nkw.Init(num_word, num_topic, max_count); // max_count bounds any count
+//   nkw.AddCount(w, k);
+//   nkw.UpdateCount(w, old_topic, new_topic);
+//   for (auto pair : nkw.Row(w)) { ... pair.top_, pair.cnt_ ... }
+//
+// All rows live in one slab of fixed-size chunks. A row takes a block of
+// 2^c entries from size class c, grows or shrinks by moving to the next
+// class, and returns its old block to the free list of its class. An entry
+// packs a pair into one integer as cnt << shift | topic, so comparing
+// entries by their high bits orders them by count. Entries are 32 bits
+// when K and max_count fit, 64 bits otherwise.
+//
+// Rows with many nonzero topics also keep a dense index from topic to
+// position, so lookups on hot words are O(1). The index is built when a row
+// grows past max(DENSE_THRESHOLD, K / 8) topics, so it never outweighs the
+// row by much, and dropped when the row shrinks below half of that. Short
+// rows are searched with SIMD compares.
+//
+// Note:
+// - A RowView is invalidated by the next update of its row.
+// - Chunks never move, so blocks stay put while other rows change.
+// - Freed blocks are reused within their class but never returned.
+// - Different rows may be updated by different threads at once. Only the
+//   pool is shared, it is locked when a row changes class or gains or drops
+//   its dense index, and its directories are reserved in Init() so they
+//   never move under a reader.
 #pragma once
 
 #include "util.h"
+#include "logger.h"
 
+#include <stdint.h>
+#include <string.h>
+#include <mutex>
 #include <vector>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 struct SparseCount {
   struct CountPair {
     int top_, cnt_;
     CountPair(int t, int c) : top_(t), cnt_(c) {}
   };
-  std::vector<CountPair> item_;
 
-  void AddCount(int topic) {
-    int index = -1;
-    for (int i = 0; i < (int)item_.size(); ++i) {
-      if (item_[i].top_ == topic) {
-        index = i;
+  struct RowInfo {
+    uint32_t offset_ = 0; // first entry of the block
+    uint32_t size_ = 0;
+    int32_t cls_ = -1; // capacity is 1 << cls_, -1 if no block
+    int32_t index_ = -1; // dense index id, -1 for short rows
+  };
+
+  // Read-only view of one row, decodes entries on access
+  struct RowView {
+    const uint8_t *data_;
+    int size_, width_, shift_;
+    uint64_t mask_;
+
+    int size() const { return size_; }
+
+    CountPair operator[](int i) const {
+      uint64_t e = (width_ == 4) ? reinterpret_cast<const uint32_t*>(data_)[i]
+                                 : reinterpret_cast<const uint64_t*>(data_)[i];
+      return CountPair(e & mask_, e >> shift_);
+    }
+
+    // Call f(i, pair) for every entry, with the width dispatched once
+    template <typename F>
+    void ForEach(F f) const {
+      if (width_ == 4) {
+        for_each<uint32_t>(f);
+      } else {
+        for_each<uint64_t>(f);
       }
     }
-    if (index != -1) {
-      increment_existing(index);
+
+    template <typename T, typename F>
+    void for_each(F f) const {
+      const T *p = reinterpret_cast<const T*>(data_);
+      T mask = mask_;
+      int shift = shift_;
+      for (int i = 0; i < size_; ++i) {
+        f(i, CountPair(p[i] & mask, p[i] >> shift));
+      }
+    }
+
+    struct Iterator {
+      const RowView *view_;
+      int i_;
+      CountPair operator*() const { return (*view_)[i_]; }
+      Iterator& operator++() { ++i_; return *this; }
+      bool operator!=(const Iterator& o) const { return i_ != o.i_; }
+    };
+    Iterator begin() const { return {this, 0}; }
+    Iterator end() const { return {this, size_}; }
+  };
+
+  struct PoolLock { // copies of a table get their own lock
+    std::mutex mutex_;
+    PoolLock() {}
+    PoolLock(const PoolLock&) {}
+    PoolLock& operator=(const PoolLock&) { return *this; }
+  };
+
+  static const int DENSE_THRESHOLD = 64; // min nonzero topics for a dense index
+  static const int CHUNK_BYTES = 1 << 20; // at least, a chunk holds a row of K entries
+
+  int width_ = 8; // bytes per entry
+  int shift_ = 32; // count bits start here
+  uint64_t mask_ = 0xffffffffULL; // topic bits
+  int chunk_shift_ = 17; // log2 of entries per chunk
+  int dense_threshold_ = DENSE_THRESHOLD;
+  std::vector<RowInfo> row_;
+  std::vector<std::vector<uint64_t>> chunk_; // 1 << chunk_shift_ entries each, never resized
+  uint64_t top_ = 0; // bump pointer, in entries, reaches 1 << 32 when full
+  std::vector<std::vector<uint32_t>> free_; // free blocks per size class
+  std::vector<std::vector<int>> index_; // topic to position, -1 if absent
+  std::vector<int> free_index_;
+  PoolLock lock_; // guards chunk_, top_, free_, index_ and free_index_
+
+  void Init(int num_word, int num_topic, long long max_count) {
+    int topic_bits = 0;
+    while ((1LL << topic_bits) < num_topic) {
+      ++topic_bits;
+    }
+    bool narrow = (topic_bits < 32 and max_count < (1LL << (32 - topic_bits)));
+    width_ = narrow ? 4 : 8;
+    shift_ = narrow ? topic_bits : 32;
+    mask_ = (1ULL << shift_) - 1;
+    dense_threshold_ = std::max((int)DENSE_THRESHOLD, num_topic / 8); // a copy, std::max binds references
+    chunk_shift_ = class_of(num_topic);
+    while ((1 << chunk_shift_) * width_ < CHUNK_BYTES) {
+      ++chunk_shift_;
+    }
+    row_.assign(num_word, RowInfo());
+    chunk_.clear();
+    chunk_.reserve((1ULL << 32) >> chunk_shift_); // every 32-bit offset
+    top_ = 0;
+    free_.assign(chunk_shift_ + 1, std::vector<uint32_t>());
+    index_.clear();
+    index_.reserve(num_word); // at most one per row
+    free_index_.clear();
+  }
+
+  void Resize(int num_word) { // new rows are empty
+    row_.resize(num_word);
+    index_.reserve(num_word);
+  }
+
+  int NumWord() const {
+    return row_.size();
+  }
+
+  int Size(int w) const {
+    return row_[w].size_;
+  }
+
+  RowView Row(int w) const {
+    const auto& r = row_[w];
+    return {r.size_ ? at(r.offset_) : NULL, (int)r.size_, width_, shift_, mask_};
+  }
+
+  int Count(int w, int topic) const {
+    int index = find(row_[w], topic);
+    return (index == -1) ? 0 : Row(w)[index].cnt_;
+  }
+
+  void AddCount(int w, int topic) {
+    if (width_ == 4) {
+      add_count<uint32_t>(row_[w], topic);
     } else {
-      item_.emplace_back(topic, 1);
+      add_count<uint64_t>(row_[w], topic);
     }
   }
 
-  void UpdateCount(int old_topic, int new_topic) {
+  void UpdateCount(int w, int old_topic, int new_topic) {
     if (old_topic == new_topic) {
       return;
     }
+    if (width_ == 4) {
+      update_count<uint32_t>(row_[w], old_topic, new_topic);
+    } else {
+      update_count<uint64_t>(row_[w], old_topic, new_topic);
+    }
+  }
 
-    // Find old and new index
-    int old_index = -1;
-    int new_index = -1;
-    for (size_t i = 0; i < item_.size(); ++i) {
-      if (item_[i].top_ == old_topic) {
-        old_index = i;
+  // Replace a row with the given pairs, kept in their order
+  void Assign(int w, const CountPair *begin, const CountPair *end) {
+    auto& r = row_[w];
+    int n = end - begin;
+    int cls = (n == 0) ? -1 : class_of(n);
+    if (cls != r.cls_) {
+      release(r);
+      if (cls != -1) {
+        r.offset_ = allocate(cls);
+        r.cls_ = cls;
       }
-      if (item_[i].top_ == new_topic) {
-        new_index = i;
+    }
+    r.size_ = n;
+    for (int i = 0; i < n; ++i) {
+      set(r, i, begin[i].top_, begin[i].cnt_);
+    }
+    reindex(r);
+  }
+
+  void Sort(int w) { // restore descending count order after Assign()
+    auto& r = row_[w];
+    if (width_ == 4) {
+      sort_row<uint32_t>(r);
+    } else {
+      sort_row<uint64_t>(r);
+    }
+    reindex(r);
+  }
+
+  size_t Bytes() const {
+    size_t bytes = row_.size() * sizeof(RowInfo)
+                   + chunk_.size() * ((size_t)width_ << chunk_shift_);
+    for (const auto& index : index_) {
+      bytes += index.capacity() * sizeof(int);
+    }
+    return bytes;
+  }
+
+  // Storage
+  uint8_t* at(uint32_t offset) const {
+    auto& chunk = const_cast<std::vector<uint64_t>&>(chunk_[offset >> chunk_shift_]);
+    return reinterpret_cast<uint8_t*>(chunk.data())
+           + (size_t)(offset & ((1u << chunk_shift_) - 1)) * width_;
+  }
+
+  template <typename T>
+  T* data(const RowInfo& r) const {
+    return reinterpret_cast<T*>(at(r.offset_));
+  }
+
+  void set(const RowInfo& r, int i, int topic, int cnt) {
+    uint64_t e = ((uint64_t)cnt << shift_) | (uint32_t)topic;
+    if (width_ == 4) {
+      data<uint32_t>(r)[i] = e;
+    } else {
+      data<uint64_t>(r)[i] = e;
+    }
+  }
+
+  static int class_of(int n) { // smallest class holding n entries
+    int cls = 0;
+    while ((1 << cls) < n) {
+      ++cls;
+    }
+    return cls;
+  }
+
+  uint32_t allocate(int cls) {
+    std::lock_guard<std::mutex> guard(lock_.mutex_);
+    uint32_t size = 1u << cls;
+    if (!free_[cls].empty()) {
+      uint32_t offset = free_[cls].back();
+      free_[cls].pop_back();
+      return offset;
+    }
+    uint32_t chunk_size = 1u << chunk_shift_;
+    if (chunk_.empty() or (top_ & (chunk_size - 1)) + size > chunk_size
+        or top_ == chunk_.size() * chunk_size) {
+      if (chunk_.size() == chunk_.capacity()) { // offsets are 32-bit, chunks never move
+        lg.Fatalf("SparseCount pool is full, %zu chunks of %u entries", chunk_.size(), chunk_size);
+      }
+      // Hand the rest of the current chunk to the free lists, largest first
+      uint64_t end = chunk_.size() * chunk_size;
+      while (top_ < end) {
+        int c = chunk_shift_;
+        while ((1u << c) > end - top_ or (top_ & ((1u << c) - 1)) != 0) {
+          --c;
+        }
+        free_[c].push_back((uint32_t)top_);
+        top_ += 1u << c;
+      }
+      chunk_.emplace_back(((size_t)width_ << chunk_shift_) / sizeof(uint64_t));
+      top_ = end;
+    }
+    uint32_t offset = (uint32_t)top_;
+    top_ += size;
+    return offset;
+  }
+
+  void release(RowInfo& r) {
+    if (r.cls_ != -1) {
+      std::lock_guard<std::mutex> guard(lock_.mutex_);
+      free_[r.cls_].push_back(r.offset_);
+      r.cls_ = -1;
+    }
+  }
+
+  void move_to(RowInfo& r, int cls) { // copy the row into a block of another class
+    uint32_t offset = allocate(cls);
+    memcpy(at(offset), at(r.offset_), (size_t)r.size_ * width_);
+    release(r);
+    r.offset_ = offset;
+    r.cls_ = cls;
+  }
+
+  // Dense index
+  void reindex(RowInfo& r) { // rebuild or drop the dense index to match the row
+    drop_index(r);
+    if ((int)r.size_ > dense_threshold_) {
+      build_index(r);
+    }
+  }
+
+  void build_index(RowInfo& r) {
+    RowView view = {at(r.offset_), (int)r.size_, width_, shift_, mask_};
+    int max_topic = 0;
+    for (auto pair : view) {
+      max_topic = std::max(max_topic, pair.top_);
+    }
+    {
+      std::lock_guard<std::mutex> guard(lock_.mutex_);
+      if (free_index_.empty()) {
+        free_index_.push_back(index_.size());
+        index_.emplace_back();
+      }
+      r.index_ = free_index_.back();
+      free_index_.pop_back();
+    }
+    auto& index = index_[r.index_];
+    index.assign(max_topic + 1, -1);
+    for (int i = 0; i < view.size(); ++i) {
+      index[view[i].top_] = i;
+    }
+  }
+
+  void drop_index(RowInfo& r) {
+    if (r.index_ != -1) {
+      index_[r.index_].clear();
+      index_[r.index_].shrink_to_fit();
+      std::lock_guard<std::mutex> guard(lock_.mutex_);
+      free_index_.push_back(r.index_);
+      r.index_ = -1;
+    }
+  }
+
+  // Position of topic in the row, -1 if absent
+  int find(const RowInfo& r, int topic) const {
+    if (r.index_ != -1) {
+      const auto& index = index_[r.index_];
+      return (topic < (int)index.size()) ? index[topic] : -1;
+    }
+    int n = r.size_;
+    if (n == 0) {
+      return -1;
+    }
+    const uint8_t *p = at(r.offset_);
+    int i = 0;
+    if (width_ == 4) { // topics are the low bits of every lane
+      const uint32_t *q = reinterpret_cast<const uint32_t*>(p);
+#if defined(__AVX2__)
+      __m256i key8 = _mm256_set1_epi32(topic), mask8 = _mm256_set1_epi32(mask_);
+      for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + i)), mask8);
+        int hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key8)));
+        if (hit != 0) {
+          return i + __builtin_ctz(hit);
+        }
       }
-      if (old_index != -1 and new_index != -1) { // early stop
-        break;
+#endif
+#if defined(__SSE2__)
+      __m128i key4 = _mm_set1_epi32(topic), mask4 = _mm_set1_epi32(mask_);
+      for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(q + i)), mask4);
+        int hit = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key4)));
+        if (hit != 0) {
+          return i + __builtin_ctz(hit);
+        }
       }
+#endif
+      for (; i < n; ++i) {
+        if ((int)(q[i] & mask_) == topic) {
+          return i;
+        }
+      }
+    } else { // topics are the even 32-bit lanes
+      const uint64_t *q = reinterpret_cast<const uint64_t*>(p);
+#if defined(__AVX2__)
+      __m256i key8 = _mm256_set1_epi32(topic);
+      for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + i));
+        int hit = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, key8))) & 0x55;
+        if (hit != 0) {
+          return i + (__builtin_ctz(hit) >> 1);
+        }
+      }
+#endif
+#if defined(__SSE2__)
+      __m128i key4 = _mm_set1_epi32(topic);
+      for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + i));
+        int hit = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key4))) & 0x5;
+        if (hit != 0) {
+          return i + (__builtin_ctz(hit) >> 1);
+        }
+      }
+#endif
+      for (; i < n; ++i) {
+        if ((int)(q[i] & mask_) == topic) {
+          return i;
+        }
+      }
+    }
+    return -1;
+  }
+
+  void place(const RowInfo& r, int i, int topic) { // record a position in the dense index
+    if (r.index_ != -1) {
+      index_[r.index_][topic] = i;
     }
+  }
+
+  // Updates on packed entries of type T
+  template <typename T>
+  void add_count(RowInfo& r, int topic) {
+    int index = find(r, topic);
+    if (index != -1) {
+      increment_existing<T>(r, index);
+    } else {
+      push_back<T>(r, topic);
+    }
+  }
+
+  template <typename T>
+  void update_count(RowInfo& r, int old_topic, int new_topic) {
+    // Find old and new index
+    int old_index = find(r, old_topic);
+    int new_index = find(r, new_topic);
 
     // Decrement old index while maintaining new index
-    CountPair temp(item_[old_index].top_, item_[old_index].cnt_ - 1);
-    int last_index = item_.size() - 1;
-    if (item_[old_index].cnt_ == 1) {
+    T *p = data<T>(r);
+    T one = (T)1 << shift_;
+    auto cnt = [this](T e) { return e >> shift_; };
+    T temp = p[old_index] - one;
+    int last_index = r.size_ - 1;
+    if (cnt(p[old_index]) == 1) {
       if (new_index == last_index) { // maintain
         new_index = old_index;
       }
-      std::swap(item_[old_index], item_.back()); // swap with last/self
-      item_.pop_back();
+      std::swap(p[old_index], p[last_index]); // swap with last/self
+      place(r, old_index, p[old_index] & mask_);
+      pop_back<T>(r);
     } // end of "need to shrink"
-    else if (old_index < last_index and temp.cnt_ < item_[old_index+1].cnt_) {
-      auto it = std::lower_bound(item_.begin() + old_index + 1,
-                                 item_.end(),
-                                 temp,
-                                 [](CountPair a, CountPair b){ return a.cnt_ > b.cnt_; })-1;
-      if (item_.begin() + new_index == it) { // maintain
+    else if (old_index < last_index and cnt(temp) < cnt(p[old_index+1])) {
+      T *it = std::lower_bound(p + old_index + 1, p + r.size_, temp,
+                               [&cnt](T a, T b){ return cnt(a) > cnt(b); }) - 1;
+      if (p + new_index == it) { // maintain
         new_index = old_index;
       }
-      item_[old_index] = *it;
+      p[old_index] = *it;
       *it = temp;
+      place(r, old_index, p[old_index] & mask_);
+      place(r, it - p, temp & mask_);
     } // end of "no need to shrink but need to rearrange"
     else {
-      --item_[old_index].cnt_;
+      p[old_index] = temp;
     } // end of "no need to rearrange"
-      
+
     // Increment new
     if (new_index != -1) {
-      increment_existing(new_index);
+      increment_existing<T>(r, new_index);
     } else {
-      item_.emplace_back(new_topic, 1);
+      push_back<T>(r, new_topic);
     }
   }
 
-  void increment_existing(int index) {
-    CountPair temp(item_[index].top_, item_[index].cnt_ + 1);
-    if (index > 0 and temp.cnt_ > item_[index-1].cnt_) {
-      auto it = std::upper_bound(item_.begin(),
-                                 item_.begin() + index,
-                                 temp,
-                                 [](CountPair a, CountPair b){ return a.cnt_ > b.cnt_; });
-      item_[index] = *it;
+  template <typename T>
+  void increment_existing(RowInfo& r, int index) {
+    T *p = data<T>(r);
+    auto cnt = [this](T e) { return e >> shift_; };
+    T temp = p[index] + ((T)1 << shift_);
+    if (index > 0 and cnt(temp) > cnt(p[index-1])) {
+      T *it = std::upper_bound(p, p + index, temp,
+                               [&cnt](T a, T b){ return cnt(a) > cnt(b); });
+      p[index] = *it;
       *it = temp;
+      place(r, index, p[index] & mask_);
+      place(r, it - p, temp & mask_);
     } // end of "need to rearrange"
     else {
-      ++item_[index].cnt_;
+      p[index] = temp;
     } // end of "no need to rearrange"
   }
 
-  EArray Array(int len) {
-    EArray arr(len);
-    for (const auto& pr : item_) {
-      arr(pr.top_) = pr.cnt_;
+  template <typename T>
+  void push_back(RowInfo& r, int topic) { // append with count 1, the lowest possible
+    if (r.cls_ == -1) {
+      r.offset_ = allocate(0);
+      r.cls_ = 0;
+    } else if (r.size_ == (1u << r.cls_)) {
+      move_to(r, r.cls_ + 1);
+    }
+    data<T>(r)[r.size_++] = ((T)1 << shift_) | (uint32_t)topic;
+    if (r.index_ != -1) {
+      auto& index = index_[r.index_];
+      if (topic >= (int)index.size()) {
+        index.resize(topic + 1, -1);
+      }
+      index[topic] = r.size_ - 1;
+    } else if ((int)r.size_ > dense_threshold_) {
+      build_index(r);
+    }
+  }
+
+  template <typename T>
+  void pop_back(RowInfo& r) {
+    if (r.index_ != -1) {
+      index_[r.index_][data<T>(r)[r.size_ - 1] & mask_] = -1;
+    }
+    --r.size_;
+    if (r.index_ != -1 and (int)r.size_ < dense_threshold_ / 2) {
+      drop_index(r);
+    }
+    if (r.size_ == 0) {
+      release(r);
+    } else if (r.cls_ > 0 and r.size_ <= (1u << r.cls_) / 4) { // shrink with hysteresis
+      move_to(r, r.cls_ - 1);
+    }
+  }
+
+  template <typename T>
+  void sort_row(RowInfo& r) {
+    if (r.size_ == 0) {
+      return;
     }
-    return arr;
+    T *p = data<T>(r);
+    int shift = shift_;
+    std::sort(p, p + r.size_, [shift](T a, T b){ return (a >> shift) > (b >> shift); });
   }
 };
@@ -0,0 +1,301 @@
+// Tests of the dict and round trips of the trainer on a small synthetic
+// corpus. A failed check exits through lg.Fatalf, so make test stops at the
+// first failure.
+//
+// Usage:
+//   make test
+//   ./sparselda_test -test_dir /tmp
+#include "../dict.h"
+#include "../flag.h"
+#include "../model.h"
+#include "../simd.h"
+#include "../rng.h"
+#include "../corpus.h"
+#include "../trainer.h"
+#include "../bench/synthetic.h"
+
+#include <float.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+auto *test_dir = flag.String("test_dir", "/tmp", "Directory for the test corpus and models");
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    lg.Fatalf("%s:%d: check failed: %s", __FILE__, __LINE__, #cond); \
+  } \
+} while (0)
+
+static void set_flag(const char *name, const std::string& value) {
+  auto it = flag.body_.find(name);
+  if (it == flag.body_.end()) {
+    lg.Fatalf("flag undefined: %s", name);
+  }
+  it->second->value_.Set(value.c_str());
+}
+
+static std::string train_file() { // written once per run
+  static std::string file;
+  if (file.empty()) {
+    SyntheticCorpus gen;
+    gen.num_doc_ = 2000;
+    gen.num_word_ = 3000;
+    gen.num_topic_ = 20;
+    gen.doc_length_ = 50;
+    file = *test_dir + "/sparselda_test.train";
+    gen.Write(file.c_str());
+  }
+  return file;
+}
+
+// Lookups in a frozen dict never insert, and words inserted after Freeze()
+// are found next to the frozen ones
+static void test_dict_freeze() {
+  Dict d;
+  for (int i = 0; i < 1000; ++i) {
+    CHECK(d.InsertWord("word" + std::to_string(i)) == i);
+  }
+  CHECK(d.Freeze());
+  CHECK(d.frozen_ and d.num_frozen_ == 1000);
+  for (int i = 0; i < 1000; ++i) {
+    CHECK(d.Find("word" + std::to_string(i)) == i);
+    CHECK(d.InsertWord("word" + std::to_string(i)) == i);
+  }
+  for (int i = 1000; i < 2000; ++i) {
+    CHECK(d.Find("word" + std::to_string(i)) == -1);
+  }
+  CHECK(d.Find("") == -1);
+  CHECK(d.size_ == 1000);
+
+  CHECK(d.InsertWord("held-out") == 1000);
+  CHECK(d.frozen_ and d.num_frozen_ == 1000);
+  CHECK(d.Find("held-out") == 1000);
+  CHECK(d.Find("word7") == 7);
+  CHECK(d.Find("unseen") == -1);
+  CHECK(d.size_ == 1001);
+}
+
+// A truncated or corrupt corpus cache is rebuilt from text
+static void test_corrupt_cache() {
+  Corpus text;
+  text.Load(train_file().c_str(), 1, false);
+  std::string cache_file = train_file() + ".bin";
+  auto check_reload = [&]() {
+    Corpus corpus;
+    corpus.Load(train_file().c_str(), 1, true);
+    CHECK(corpus.num_doc_ == text.num_doc_ and corpus.num_token_ == text.num_token_);
+    for (int j = 0; j < corpus.num_token_; ++j) {
+      CHECK(corpus.tok_[j] == text.tok_[j]);
+    }
+  };
+  check_reload(); // writes the cache
+  CHECK(truncate(cache_file.c_str(), 4096) == 0);
+  check_reload();
+
+  // An out of range token id in the last word of the file
+  int64_t size = 0, mtime = 0;
+  CHECK(Corpus::file_stat(cache_file.c_str(), &size, &mtime));
+  FILE *fp = fopen(cache_file.c_str(), "r+b");
+  CHECK(fp != nullptr);
+  CacheHeader h;
+  CHECK(fread(&h, sizeof(h), 1, fp) == 1);
+  int64_t token_pos = Writer::Align8(sizeof(h)) + Writer::Align8((h.num_doc_ + 1) * sizeof(int32_t));
+  uint32_t bad = 0xffffffff;
+  fseek(fp, token_pos, SEEK_SET);
+  CHECK(fwrite(&bad, h.tok_width_, 1, fp) == 1);
+  fclose(fp);
+  check_reload();
+  unlink(cache_file.c_str());
+}
+
+// Every vector level gives the scalar LowerBound, and the scalar sums up to
+// the rounding of the lane order, on rows around the vector widths
+template <typename Entry>
+static void check_simd_rows(int shift) {
+  const int num_topic = 200;
+  std::vector<real> coeff(num_topic);
+  for (auto& c : coeff) {
+    c = 0.01f + Unif01();
+  }
+  for (int n : {15, 16, 17, 31, 33, 100}) {
+    std::vector<Entry> entry(n);
+    for (int i = 0; i < n; ++i) {
+      entry[i] = ((Entry)(1 + Dice(1000)) << shift) | Dice(num_topic);
+    }
+    int topic = entry[n / 2] & (((Entry)1 << shift) - 1);
+    for (int skip : {-1, topic}) {
+      std::vector<real> ref(n), out(n);
+      Simd::level_ = SIMD_LEVEL_SCALAR;
+      real ref_sum = Simd::PrefixSum(entry.data(), n, shift, coeff.data(), skip, 1.0f, ref.data());
+      real ref_dot = Simd::Dot(entry.data(), n, shift, coeff.data(), 1.0f);
+      std::vector<real> probe = {-1.0f, 0.0f, ref[0], ref[n - 1], ref[n - 1] + 1.0f};
+      for (int i = 0; i < n; ++i) {
+        probe.push_back(ref[i]);
+        probe.push_back(std::nextafter(ref[i], 0.0f));
+      }
+      for (const char *level : {"avx2", "avx512"}) {
+        if (!Simd::Init(level)) {
+          continue;
+        }
+        auto near = [n](real a, real b) { // the sum of n terms, a few ulp each
+          return fabsf(a - b) <= 4 * n * FLT_EPSILON * fabsf(b);
+        };
+        CHECK(near(Simd::PrefixSum(entry.data(), n, shift, coeff.data(), skip, 1.0f, out.data()),
+                   ref_sum));
+        for (int i = 0; i < n; ++i) {
+          CHECK(near(out[i], ref[i]));
+        }
+        CHECK(near(Simd::Dot(entry.data(), n, shift, coeff.data(), 1.0f), ref_dot));
+        for (real u : probe) {
+          CHECK(Simd::LowerBound(ref.data(), n, u)
+                == std::lower_bound(ref.begin(), ref.end(), u) - ref.begin());
+        }
+      }
+    }
+  }
+}
+
+static void test_simd() {
+  SimdLevel level = Simd::level_;
+  SeedUnif01(1);
+  check_simd_rows<uint32_t>(8);
+  check_simd_rows<uint64_t>(32);
+  Simd::level_ = level;
+}
+
+// Philox4x32-10 known answers from Random123, then Fill() against
+// next_block() over odd lengths and across the carry into ctr_[1]
+static void test_philox() {
+  struct { uint32_t ctr[4], key[2], out[4]; } kat[] = {
+    {{0, 0, 0, 0}, {0, 0},
+     {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+    {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff},
+     {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+    {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0},
+     {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+  };
+  for (const auto& t : kat) {
+    uint32_t out[4];
+    Philox::Block(t.key, t.ctr, out);
+    for (int j = 0; j < 4; ++j) {
+      CHECK(out[j] == t.out[j]);
+    }
+  }
+
+  for (uint32_t start : {0u, UINT32_MAX - 40, UINT32_MAX - 9, UINT32_MAX - 8, UINT32_MAX - 4,
+                         UINT32_MAX - 3, UINT32_MAX}) {
+    for (int n : {1, 3, 4, 5, 15, 16, 17, 31, 32, 33, 100, 257}) {
+      Philox fill(0x123456789abcdefULL, 42), block = fill;
+      fill.ctr_[0] = block.ctr_[0] = start;
+      fill.ctr_[1] = block.ctr_[1] = 7;
+      std::vector<float> got(n), want(n + 3);
+      fill.Fill(got.data(), n);
+      for (int i = 0; i < n; i += 4) {
+        block.next_block(&want[i]);
+      }
+      for (int i = 0; i < n; ++i) {
+        CHECK(got[i] == want[i]);
+      }
+      for (int j = 0; j < 4; ++j) { // the next Fill() starts at the same block
+        CHECK(fill.ctr_[j] == block.ctr_[j]);
+      }
+      uint64_t blocks = ((uint64_t)block.ctr_[1] << 32 | block.ctr_[0]) - (7ULL << 32 | start);
+      CHECK(blocks == (uint64_t)(n + 3) / 4);
+    }
+  }
+}
+
+// A model-parallel run sorts the tokens of every document by word, the
+// checkpoint must still hold them in file order so that it resumes
+static void test_model_parallel_resume() {
+  std::string prefix = *test_dir + "/sparselda_test_mp";
+  set_flag("train_file", train_file());
+  set_flag("num_topic", "20");
+  set_flag("num_iter", "2");
+  set_flag("num_thread", "3");
+  set_flag("parallel", "model");
+  set_flag("dump_prefix", prefix);
+  {
+    Trainer trainer;
+    trainer.Train();
+  }
+
+  ModelView model;
+  CHECK(model.Open((prefix + ".model").c_str()));
+  CHECK(model.header_.flags_ & MODEL_HAS_ASSIGNMENT);
+  Corpus corpus;
+  corpus.Load(train_file().c_str(), 1, false);
+  CHECK(model.header_.num_doc_ == corpus.num_doc_);
+  CHECK(model.header_.num_token_ == corpus.num_token_);
+  for (int d = 0; d <= corpus.num_doc_; ++d) {
+    CHECK(model.doc_offset_[d] == corpus.offset_[d]);
+  }
+  for (int j = 0; j < corpus.num_token_; ++j) {
+    CHECK(model.tok_[j] == corpus.tok_[j]);
+  }
+
+  // Resuming checks the corpus again, in both parallel schemes
+  for (const char *parallel : {"model", "data"}) {
+    set_flag("parallel", parallel);
+    set_flag("resume_from", prefix + ".model");
+    set_flag("dump_prefix", prefix + "_resumed");
+    Trainer trainer;
+    trainer.Train();
+  }
+  set_flag("resume_from", "");
+  set_flag("dump_prefix", "");
+  set_flag("num_thread", "1");
+}
+
+// A truncated checkpoint, or one with offsets out of order, is rejected
+static void test_corrupt_model() {
+  std::string model_file = *test_dir + "/sparselda_test_mp.model";
+  std::string bad_file = *test_dir + "/sparselda_test_bad.model";
+  ModelView model;
+  CHECK(model.Open(model_file.c_str()));
+  int64_t row_offset_pos = (const char*)model.row_offset_ - model.file_->data_;
+  int64_t size = model.file_->size_;
+  auto copy = [&](int64_t bytes) {
+    FILE *in = fopen(model_file.c_str(), "rb"), *out = fopen(bad_file.c_str(), "wb");
+    CHECK(in != nullptr and out != nullptr);
+    std::string data(bytes, 0);
+    CHECK(fread(&data[0], 1, bytes, in) == (size_t)bytes);
+    CHECK(fwrite(data.data(), 1, bytes, out) == (size_t)bytes);
+    fclose(in);
+    fclose(out);
+  };
+  copy(size);
+  CHECK(ModelView().Open(bad_file.c_str()));
+  copy(size / 2);
+  CHECK(!ModelView().Open(bad_file.c_str()));
+  copy(4096);
+  CHECK(!ModelView().Open(bad_file.c_str()));
+
+  copy(size);
+  FILE *fp = fopen(bad_file.c_str(), "r+b");
+  int64_t bad = 1LL << 40;
+  fseek(fp, row_offset_pos + sizeof(int64_t), SEEK_SET);
+  CHECK(fwrite(&bad, sizeof(bad), 1, fp) == 1);
+  fclose(fp);
+  CHECK(!ModelView().Open(bad_file.c_str()));
+  unlink(bad_file.c_str());
+}
+
+int main(int argc, char** argv) {
+  flag.Parse(argc, argv);
+  struct { const char *name; void (*run)(); } tests[] = {
+    {"dict_freeze", test_dict_freeze},
+    {"corrupt_cache", test_corrupt_cache},
+    {"simd", test_simd},
+    {"philox", test_philox},
+    {"model_parallel_resume", test_model_parallel_resume},
+    {"corrupt_model", test_corrupt_model},
+  };
+  for (const auto& t : tests) {
+    t.run();
+    lg.Printf("PASS %s", t.name);
+  }
+  return 0;
+}
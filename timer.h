@@ -1,19 +1,49 @@
-// A simple RAII Timer. 
+// A simple RAII Timer, which doubles as a profiling zone.
 //
 // Usage:
 //   {
 //     Timer timer("LoadData");
 //     ...
 //   }
-// 
+//   {
+//     Zone zone("sweep"); // silent, only seen by the profiler
+//     ...
+//   }
+//   prof.Enable(true, false); // record zones, keep trace events
+//   ...
+//   prof.Report();
+//   prof.WriteTrace("trace.json");
+//
 // Note:
-// - Use Get() to behave like a traditional non-RAII timer.
+// - Use Get() to behave like a traditional non-RAII timer, Stop() to end the
+//   zone early without the dying message.
+// - Zones nest per thread, a zone is aggregated under the path of its
+//   enclosing zones, e.g. sweep/merge_workers. The first zone of a spawned
+//   thread takes the path of the spawning thread, Zone(name, parent) with
+//   parent = Profiler::path() captured before the spawn.
+// - Disabled zones cost one branch. Enable() must be called before zones are
+//   entered on other threads.
+// - Hardware counters (cache and branch misses) use perf_event_open and are
+//   only read in zones of the thread that called Enable(), including the
+//   threads it joined in between.
 #pragma once
 
 #include "logger.h"
 
 #include <time.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
 
 #define MAX_NAME_SIZE 128
 
@@ -24,10 +54,205 @@ static double get_time() {
   return (start.tv_sec + start.tv_nsec/1e+9);
 }
 
+struct Profiler {
+  static const int NUM_COUNTER = 2; // cache misses, branch misses
+
+  struct ZoneStat {
+    std::vector<double> sec_; // every call
+    long long counter_[NUM_COUNTER] = {0, 0};
+  };
+
+  struct TraceEvent {
+    std::string name_;
+    int tid_;
+    double start_, sec_;
+  };
+
+  bool enabled_ = false;
+  bool trace_ = false;
+  double origin_ = 0.0; // trace timestamps start here
+  std::mutex mutex_;
+  std::map<std::string, ZoneStat> zone_; // by path
+  std::vector<TraceEvent> event_;
+  int perf_fd_[NUM_COUNTER] = {-1, -1};
+  std::thread::id perf_thread_;
+
+  static Profiler& instance() { // singleton
+    static Profiler e;
+    return e;
+  }
+
+  static std::string& path() { // enclosing zones of the calling thread
+    static thread_local std::string p;
+    return p;
+  }
+
+  static int tid() { // small id of the calling thread, for the trace
+    static std::atomic<int> next(0);
+    static thread_local int id = next++;
+    return id;
+  }
+
+  void Enable(bool trace, bool perf_counters) {
+    enabled_ = true;
+    trace_ = trace;
+    origin_ = get_time();
+    if (perf_counters) {
+      uint64_t config[NUM_COUNTER] = {PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+      for (int i = 0; i < NUM_COUNTER; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[i];
+        attr.inherit = 1; // threads started later are counted once joined
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_fd_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+      }
+      if (perf_fd_[0] < 0 or perf_fd_[1] < 0) {
+        lg.Printf("perf_event_open failed, zones without hardware counters");
+        for (int& fd : perf_fd_) {
+          if (fd >= 0) {
+            close(fd);
+          }
+          fd = -1;
+        }
+      }
+      perf_thread_ = std::this_thread::get_id();
+    }
+  }
+
+  // Read the counters into value, false if they are not kept for this thread
+  bool ReadCounters(long long *value) const {
+    if (perf_fd_[0] < 0 or std::this_thread::get_id() != perf_thread_) {
+      return false;
+    }
+    for (int i = 0; i < NUM_COUNTER; ++i) {
+      if (read(perf_fd_[i], &value[i], sizeof(long long)) != sizeof(long long)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Record(const std::string& path, const char *name, double start, double sec,
+              const long long *counter) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto& stat = zone_[path];
+    stat.sec_.push_back(sec);
+    if (counter != NULL) {
+      for (int i = 0; i < NUM_COUNTER; ++i) {
+        stat.counter_[i] += counter[i];
+      }
+    }
+    if (trace_) {
+      event_.push_back({name, tid(), start - origin_, sec});
+    }
+  }
+
+  // Log calls, total and percentiles of every zone, indented by depth
+  void Report() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    lg.Printf("%-36s%8s%12s%10s%10s%10s%10s%14s%14s", "zone", "calls", "total",
+              "p50", "p90", "p99", "max", "cache_miss", "branch_miss");
+    for (auto& it : zone_) {
+      auto sec = it.second.sec_;
+      std::sort(sec.begin(), sec.end());
+      double total = 0.0;
+      for (double x : sec) {
+        total += x;
+      }
+      int n = sec.size();
+      auto pct = [&sec, n](double q) { return sec[std::min(n - 1, (int)(q * n))]; };
+      int depth = std::count(it.first.begin(), it.first.end(), '/');
+      std::string name = std::string(2 * depth, ' ') + it.first.substr(it.first.rfind('/') + 1);
+      lg.Printf("%-36s%8d%12.4lf%10.4lf%10.4lf%10.4lf%10.4lf%14lld%14lld", name.c_str(), n,
+                total, pct(0.5), pct(0.9), pct(0.99), sec.back(),
+                it.second.counter_[0], it.second.counter_[1]);
+    }
+  }
+
+  // Chrome trace-event JSON, opens in Perfetto or chrome://tracing
+  bool WriteTrace(const char *file) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    FILE *fp = fopen(file, "w");
+    if (fp == NULL) {
+      return false;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < event_.size(); ++i) {
+      const auto& e = event_[i];
+      fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3lf,\"dur\":%.3lf}%s\n",
+              e.name_.c_str(), e.tid_, e.start_ * 1e6, e.sec_ * 1e6,
+              (i + 1 < event_.size()) ? "," : "");
+    }
+    fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(fp) == 0;
+  }
+};
+
+static auto& prof = Profiler::instance();
+
+// RAII profiling zone, does nothing unless the profiler is enabled
+struct Zone {
+  const char *name_ = NULL;
+  double start_;
+  size_t path_size_; // enclosing path, restored on exit
+  long long counter_[Profiler::NUM_COUNTER];
+  bool active_ = false, counted_ = false;
+
+  Zone() {}
+  explicit Zone(const char *name) { Begin(name); }
+  Zone(const char *name, const std::string& parent) { // first zone of a new thread
+    if (prof.enabled_) {
+      Profiler::path() = parent;
+      Begin(name);
+      path_size_ = 0; // the thread started with an empty path
+    }
+  }
+  ~Zone() { End(); }
+
+  void Begin(const char *name) { // name must outlive the zone
+    if (!prof.enabled_) {
+      return;
+    }
+    name_ = name;
+    active_ = true;
+    auto& path = Profiler::path();
+    path_size_ = path.size();
+    if (!path.empty()) {
+      path += '/';
+    }
+    path += name;
+    counted_ = prof.ReadCounters(counter_);
+    start_ = get_time();
+  }
+
+  void End() {
+    if (!active_) {
+      return;
+    }
+    active_ = false;
+    double sec = get_time() - start_;
+    long long now[Profiler::NUM_COUNTER];
+    bool counted = counted_ and prof.ReadCounters(now);
+    if (counted) {
+      for (int i = 0; i < Profiler::NUM_COUNTER; ++i) {
+        now[i] -= counter_[i];
+      }
+    }
+    auto& path = Profiler::path();
+    prof.Record(path, name_, start_, sec, counted ? now : NULL);
+    path.resize(path_size_);
+  }
+};
+
 struct Timer {
   bool dying_msg_;
   char name_[MAX_NAME_SIZE];
   double start_;
+  Zone zone_; // profiling zone of the same name
 
   Timer(const char* fmt, ...) {
     va_list ap;
@@ -35,6 +260,7 @@ struct Timer {
     vsnprintf(name_, MAX_NAME_SIZE, fmt, ap);
     va_end(ap);
     dying_msg_ = true;
+    zone_.Begin(name_);
     start_ = get_time();
   }
 
@@ -48,4 +274,10 @@ struct Timer {
     dying_msg_ = false;
     return get_time() - start_;
   }
+
+  double Stop() { // end the zone now, without the dying message
+    dying_msg_ = false;
+    zone_.End();
+    return get_time() - start_;
+  }
 };
@@ -4,205 +4,1261 @@
 #include "flag.h"
 #include "util.h"
 
-#include <list>
+#include <thread>
 #include <algorithm>
 
 auto *train_file = flag.String("train_file", "", "Text file in LIBSVM format");
 auto *test_file = flag.String("test_file", "", "Text file in LIBSVM format");
+auto *cache_corpus = flag.Bool("cache_corpus", false, "Cache parsed corpora as <file>.bin and mmap them on later runs");
 auto *dump_prefix = flag.String("dump_prefix", "", "Prefix for training results");
+auto *dump_assignment = flag.Bool("dump_assignment", true, "Save the corpus and its assignments with the model");
+auto *resume_from = flag.String("resume_from", "", "Model checkpoint to continue training from");
+auto *online = flag.Bool("online", false, "With -resume_from, add the documents of train_file to the checkpoint's and sample only them and a replay window");
+auto *online_replay = flag.Float("online_replay", 1.0, "Old documents resampled per new document in an online update");
 auto *num_iter = flag.Int("num_iter", 10, "Number of training iteration");
 auto *num_topic = flag.Int("num_topic", 100, "Model size, usually called K");
+auto *num_thread = flag.Int("num_thread", 1, "Number of sampling threads");
+auto *seed = flag.Int("seed", 1, "Random seed, runs with the same seed and flags are identical");
+auto *sampler = flag.String("sampler", "sparse", "Gibbs sampler, sparse or alias");
+auto *mh_step = flag.Int("mh_step", 2, "Metropolis-Hastings steps per token, alias sampler only");
+auto *sweep_order = flag.String("sweep", "doc", "Token order of a sweep, doc or word (WarpLDA)");
+auto *stream_file = flag.String("stream_file", "", "Segment file for out-of-core training, built from train_file, which is then streamed in minibatches");
+auto *stream_batch = flag.Int("stream_batch", 1 << 22, "Tokens per minibatch when streaming");
+auto *profile = flag.Bool("profile", false, "Log call counts and time percentiles of the profiling zones");
+auto *trace_file = flag.String("trace_file", "", "Chrome trace-event JSON of the profiling zones, for Perfetto");
+auto *perf_counters = flag.Bool("perf_counters", false, "Count cache and branch misses per zone with perf_event_open");
+auto *metrics_file = flag.String("metrics_file", "", "File for one JSON line of metrics per iteration, sampler counters need make METRICS=1");
+auto *parallel = flag.String("parallel", "data", "Multithreading scheme, data (AD-LDA count copies) or model (word block rotation)");
+auto *sort_vocab = flag.Bool("sort_vocab", false, "Renumber training words by descending frequency, so hot nkw rows are adjacent");
+auto *sort_doc = flag.String("sort_doc", "none", "Sweep order of documents: none, length or similarity (dominant word)");
+auto *eval_interval = flag.Int("eval_interval", 1, "Evaluate every this many iterations, and after the last");
+auto *async_eval = flag.Bool("async_eval", false, "Evaluate snapshots of the model on a background thread while sampling goes on");
+auto *eval_backlog = flag.Int("eval_backlog", 1, "Snapshots waiting for the evaluation thread before sampling blocks, -async_eval only");
+auto *fixed_k = flag.Bool("fixed_k", true, "Use the SparseLDA kernels compiled for K up to 64, 128 or 256 when K fits");
+auto *simd = flag.String("simd", "auto", "Vector kernels for long nkw rows: auto, avx512, avx2 or scalar");
 
 const int MAX_TEST_ITER = 20;
+const int LGAMMA_TABLE = 256; // counts below this use the lgamma tables
+
+// Sum f(begin, end) over num_thread contiguous ranges of [0, n). Partial
+// sums are added in range order, so the result does not depend on timing.
+template <typename F>
+static double parallel_sum(int n, F f) {
+  int num_part = std::max(1, std::min(*num_thread, n));
+  if (num_part == 1) {
+    return f(0, n);
+  }
+  std::vector<double> part(num_part);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_part; ++t) {
+    threads.emplace_back([&part, &f, t, n, num_part]() {
+      part[t] = f((long long)n * t / num_part, (long long)n * (t + 1) / num_part);
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  double sum = 0.0;
+  for (double x : part) {
+    sum += x;
+  }
+  return sum;
+}
 
 void Trainer::Train() {
-  initialize();
+  if (*profile or *trace_file != "") {
+    prof.Enable(*trace_file != "", *perf_counters);
+  }
+  {
+    Zone zone("initialize");
+    initialize();
+  }
+  if (*async_eval) {
+    eval_thread_ = std::thread(&Trainer::evaluation_loop, this);
+  }
   lg.Printf("");
   lg.Printf("iter   iter_time       joint         llh    test_llh");
 
   // Initial statistics
-  iter_time_.push_back(0);
-  joint_.push_back(evaluate_joint());
-  llh_.push_back(evaluate_llh());
-  test_llh_.push_back(evaluate_test_llh());
-  lg.Printf("%4d%12.4lf%12.4lf%12.4lf%12.4lf",
-            0, iter_time_.back(), joint_.back(), llh_.back(), test_llh_.back());
+  evaluate(start_iter_);
 
-  for (int iter = 1; iter <= *num_iter; ++iter) {
-    Timer iter_timer("");
-    for (auto& doc : train_.corpus_) {
-      train_one_document(doc);
+  for (int iter = start_iter_ + 1; iter <= start_iter_ + *num_iter; ++iter) {
+    Timer sweep_timer("sweep");
+    sweep(iter);
+    eval_sec_ += sweep_timer.Stop(); // logged with the statistics
+    ++eval_sweep_;
+    int done = iter - start_iter_;
+    if (done % *eval_interval == 0 or done == *num_iter) {
+      evaluate(iter);
     }
-    // Collect statistics
-    iter_time_.push_back(iter_timer.Get());
-    joint_.push_back(evaluate_joint());
-    llh_.push_back(evaluate_llh());
-    test_llh_.push_back(evaluate_test_llh());
-    lg.Printf("%4d%12.4lf%12.4lf%12.4lf%12.4lf",
-              iter, iter_time_.back(), joint_.back(), llh_.back(), test_llh_.back());
   }
+  finish_evaluation();
 
   // Output
   if (*dump_prefix != "") {
     save_result();
   }
+  if (metrics_fp_ != NULL) {
+    fclose(metrics_fp_);
+  }
+  if (prof.enabled_) {
+    prof.Report();
+    if (*trace_file != "" and !prof.WriteTrace(trace_file->c_str())) {
+      lg.Printf("cannot write %s", trace_file->c_str());
+    }
+  }
 }
 
 void Trainer::initialize() {
+  SeedUnif01(*seed);
+  // Load checkpoint vocabulary first, so that its word ids stay valid
+  ModelView model;
+  bool resume = (*resume_from != "");
+  if (*online and !resume) {
+    lg.Fatalf("-online needs a checkpoint in -resume_from");
+  }
+  if (resume) {
+    if (!model.Open(resume_from->c_str())) {
+      lg.Fatalf("invalid checkpoint: %s", resume_from->c_str());
+    }
+    if (model.header_.num_topic_ != *num_topic) {
+      *num_topic = model.header_.num_topic_;
+      lg.Printf("num_topic = %d from checkpoint", *num_topic);
+    }
+    for (int w = 0; w < model.header_.num_word_; ++w) {
+      if (dict.InsertWord(model.Word(w)) != w) {
+        lg.Fatalf("duplicate word in checkpoint: %s", resume_from->c_str());
+      }
+    }
+    dict.Freeze(); // the training corpus mostly looks up checkpoint words
+  }
+
   // Init train
-  train_.ReadData(train_file->c_str());
-  nkw_.resize(dict.size_);
+  if (*stream_file != "") {
+    if (resume or *sweep_order != "doc") {
+      lg.Fatalf("-stream_file supports fresh doc-order training only");
+    }
+    Zone zone("load");
+    stream_.Build(train_file->c_str(), stream_file->c_str(), *num_topic, *stream_batch);
+    num_train_doc_ = stream_.header_.num_doc_;
+    num_train_token_ = stream_.header_.num_token_;
+    nkw_.Init(dict.size_, *num_topic, stream_.max_word_count_);
+  } else {
+    Zone zone("load");
+    train_.Load(train_file->c_str(), *num_thread, *cache_corpus);
+    train_.InitAssignment(*num_topic);
+    num_train_doc_ = train_.num_doc_;
+    num_train_token_ = train_.num_token_;
+    nkw_.Init(dict.size_, *num_topic, train_.MaxWordCount());
+  }
   nk_.setZero(*num_topic);
-  for (auto& doc : train_.corpus_) {
-    for (auto& pair : doc.body_) {
-      pair.asg_ = Dice(*num_topic);
-      nkw_[pair.tok_].AddCount(pair.asg_);
-      ++nk_(pair.asg_);
+  if (resume and *online) {
+    start_online(model);
+  } else if (resume) {
+    restore_checkpoint(model);
+  } else {
+    for_each_batch(true, [this](int) {
+      for (int j = 0; j < train_.num_token_; ++j) {
+        int topic = Dice(*num_topic);
+        train_.asg_.Set(j, topic);
+        nkw_.AddCount(train_.tok_[j], topic);
+        ++nk_(topic);
+      }
+    });
+  }
+  int num_train_word = dict.size_; // held-out words are not in the prior
+  if (dict.num_frozen_ != dict.size_) { // held-out words are mostly lookups
+    Zone zone("load");
+    dict.Freeze();
+  }
+  if (*sort_vocab or *sort_doc != "none") {
+    if (*stream_file != "") {
+      lg.Fatalf("-sort_vocab and -sort_doc need the training corpus in memory");
     }
+    relabel();
   }
+  lg.Printf("topic word counts: %d-byte entries, %.1f MB", nkw_.width_, nkw_.Bytes() / 1048576.0);
 
   // Init test
   if (*test_file != "") {
-    test_.ReadData(test_file->c_str());
+    {
+      Zone zone("load");
+      test_.Load(test_file->c_str(), *num_thread, *cache_corpus);
+    }
+    if (!word_label_.empty()) {
+      NarrowArray tok;
+      tok.Init(test_.num_token_, dict.size_ - 1);
+      for (int j = 0; j < test_.num_token_; ++j) {
+        tok.Set(j, word_label(test_.tok_[j]));
+      }
+      test_.tok_ = std::move(tok);
+      test_.cache_.reset();
+    }
+    test_.InitAssignment(*num_topic);
     // Resize the matrix
-    nkw_.resize(dict.size_);
-    test_nkw_.setZero(*num_topic, dict.size_);
+    nkw_.Resize(dict.size_);
+    test_nkw_.Init(dict.size_, *num_topic, test_.MaxWordCount());
     test_nk_.setZero(*num_topic);
-    for (auto& doc : test_.corpus_) {
-      doc.test_nkd_.setZero(*num_topic);
-      for (auto& pair : doc.body_) {
-        pair.asg_ = Dice(*num_topic);
-        ++doc.test_nkd_(pair.asg_);
-        ++test_nkw_(pair.asg_,pair.tok_);
-        ++test_nk_(pair.asg_);
-      }
+    for (int j = 0; j < test_.num_token_; ++j) {
+      int topic = Dice(*num_topic);
+      test_.asg_.Set(j, topic);
+      test_nkw_.AddCount(test_.tok_[j], topic);
+      ++test_nk_(topic);
     }
+    test_nkd_.setZero(*num_topic);
   }
 
   // Init hyperparam
-  alpha_sum_ = (real)(train_.num_token_) / train_.num_doc_ / 10; // avg doc length / 10
-  alpha_.setConstant(*num_topic, alpha_sum_ / *num_topic);
-  beta_sum_ = (real)(train_.num_token_) / *num_topic / 10; // avg topic count / 10
-  beta_ = beta_sum_ / dict.size_;
+  if (resume) {
+    alpha_ = Eigen::Map<const EArray>(model.alpha_, *num_topic);
+    alpha_sum_ = alpha_.sum();
+    beta_ = model.header_.beta_;
+    beta_sum_ = model.header_.beta_sum_;
+    if (*online) { // words new to the model join the prior
+      beta_sum_ += beta_ * (num_train_word - model.header_.num_word_);
+    }
+  } else {
+    alpha_sum_ = (real)(num_train_token_) / num_train_doc_ / 10; // avg doc length / 10
+    alpha_.setConstant(*num_topic, alpha_sum_ / *num_topic);
+    beta_sum_ = (real)(num_train_token_) / *num_topic / 10; // avg topic count / 10
+    beta_ = beta_sum_ / dict.size_;
+  }
   lg.Printf("alpha sum = %6.4lf, beta = %6.4lf", alpha_sum_, beta_);
+  build_lgamma_table();
+
+  // Init sampler
+  if (*sampler == "sparse") {
+    sampler_ = SAMPLER_SPARSE;
+  } else if (*sampler == "alias") {
+    sampler_ = SAMPLER_ALIAS;
+  } else {
+    lg.Fatalf("unknown sampler: %s", sampler->c_str());
+  }
+  std::vector<int> topic(*num_topic);
+  for (int k = 0; k < *num_topic; ++k) {
+    topic[k] = k;
+  }
+  alpha_alias_.Build(topic.data(), alpha_.data(), *num_topic);
+  if (*sweep_order == "doc") {
+    sweep_order_ = SWEEP_DOC;
+  } else if (*sweep_order == "word") {
+    sweep_order_ = SWEEP_WORD;
+    if (sampler_ != SAMPLER_SPARSE) {
+      lg.Printf("word-major sweep has its own proposals, ignoring -sampler");
+      sampler_ = SAMPLER_SPARSE;
+    }
+    build_word_major_index();
+  } else {
+    lg.Fatalf("unknown sweep order: %s", sweep_order->c_str());
+  }
+  if (*parallel == "data") {
+    parallel_ = PARALLEL_DATA;
+  } else if (*parallel == "model") {
+    parallel_ = PARALLEL_MODEL;
+    if (*stream_file != "") {
+      lg.Fatalf("-parallel model needs the training corpus in memory");
+    }
+  } else {
+    lg.Fatalf("unknown parallel scheme: %s", parallel->c_str());
+  }
+  select_kernels();
+  partition_documents();
+  if (worker_.size() > 1) {
+    lg.Printf("sampling with %d threads", (int)worker_.size());
+    if (parallel_ == PARALLEL_MODEL) {
+      build_word_blocks();
+    }
+  }
+
+  if (*eval_interval < 1 or *eval_backlog < 1) {
+    lg.Fatalf("-eval_interval and -eval_backlog must be positive");
+  }
+  if (*async_eval and *stream_file != "") {
+    lg.Fatalf("-async_eval needs the training corpus in memory");
+  }
+  if (*metrics_file != "") {
+    metrics_fp_ = fopen(metrics_file->c_str(), "w");
+    if (metrics_fp_ == NULL) {
+      lg.Fatalf("cannot open %s", metrics_file->c_str());
+    }
+#ifndef METRICS
+    lg.Printf("sampler counters are compiled out, build with make METRICS=1");
+#endif
+  }
+}
+
+// Run fn(b) with each part b of the training corpus in train_: the whole
+// corpus when it is in memory, otherwise every minibatch of the segment file
+// in turn. While fn works on one minibatch, an I/O thread writes back the
+// previous one, if write_back is set, and reads the next.
+template <typename F>
+void Trainer::for_each_batch(bool write_back, F fn) {
+  if (*stream_file == "") {
+    fn(0);
+    return;
+  }
+  int num_batch = stream_.NumBatch();
+  Corpus next, done;
+  stream_.Read(0, &train_);
+  std::string parent = Profiler::path();
+  for (int b = 0; b < num_batch; ++b) {
+    std::thread io([this, write_back, b, num_batch, &next, &done, &parent]() {
+      Zone zone("stream_io", parent);
+      if (write_back and b > 0) {
+        stream_.WriteAssignment(b - 1, done);
+      }
+      if (b + 1 < num_batch) {
+        stream_.Read(b + 1, &next);
+      }
+    });
+    fn(b);
+    io.join();
+    std::swap(done, train_);
+    std::swap(train_, next);
+  }
+  if (write_back) {
+    stream_.WriteAssignment(num_batch - 1, done);
+  }
+  train_ = Corpus(); // no stale minibatch between passes
+}
+
+void Trainer::restore_checkpoint(const ModelView& model) {
+  const auto& h = model.header_;
+  if (!(h.flags_ & MODEL_HAS_ASSIGNMENT)) {
+    lg.Fatalf("checkpoint has no assignments, save it with -dump_assignment true");
+  }
+  bool same = (h.num_doc_ == train_.num_doc_ and h.num_token_ == train_.num_token_);
+  for (int d = 0; same and d <= train_.num_doc_; ++d) {
+    same = (model.doc_offset_[d] == train_.offset_[d]);
+  }
+  for (int j = 0; same and j < train_.num_token_; ++j) {
+    same = (model.tok_[j] == train_.tok_[j]);
+  }
+  if (!same) {
+    lg.Fatalf("checkpoint was trained on a different corpus than %s", train_file->c_str());
+  }
+  for (int j = 0; j < train_.num_token_; ++j) {
+    train_.asg_.Set(j, model.asg_[j]);
+  }
+  for (int w = 0; w < h.num_word_; ++w) {
+    nkw_.Assign(w, model.RowBegin(w), model.RowEnd(w));
+  }
+  nk_ = Eigen::Map<const IArray>(model.nk_, *num_topic);
+  start_iter_ = h.num_iter_;
+  lg.Printf("resumed from %s after %d iterations", resume_from->c_str(), start_iter_);
+}
+
+// Renumber words by descending training frequency and reorder documents,
+// so hot nkw rows sit next to each other and consecutive documents touch
+// the same rows. Rows are copied in the new word order, which also lays out
+// their blocks in that order. Only the sampler sees the new ids and order,
+// save_result() maps them back.
+void Trainer::relabel() {
+  Timer relabel_timer("relabel");
+  int num_word = nkw_.NumWord();
+  std::vector<int> freq(num_word, 0);
+  for (int j = 0; j < train_.num_token_; ++j) {
+    ++freq[train_.tok_[j]];
+  }
+  std::vector<int> origin(num_word); // relabeled word id to original
+  for (int w = 0; w < num_word; ++w) {
+    origin[w] = w;
+  }
+  if (*sort_vocab) {
+    std::stable_sort(RANGE(origin), [&freq](int a, int b) { return freq[a] > freq[b]; });
+  }
+  word_label_.resize(num_word);
+  for (int w = 0; w < num_word; ++w) {
+    word_label_[origin[w]] = w;
+  }
+
+  // Document order, a stable sort by key
+  std::vector<long long> key(train_.num_doc_, 0);
+  if (*sort_doc == "length") { // longest first
+    for (int d = 0; d < train_.num_doc_; ++d) {
+      key[d] = -train_.Length(d);
+    }
+  } else if (*sort_doc == "similarity") { // most repeated word, rarer on ties
+    std::vector<int> cnt(num_word, 0);
+    auto rarer = [&freq, &origin](int a, int b) { // by corpus frequency, then later id
+      int fa = freq[origin[a]], fb = freq[origin[b]];
+      return fa < fb or (fa == fb and a > b);
+    };
+    for (int d = 0; d < train_.num_doc_; ++d) {
+      int best = -1;
+      for (int j = train_.Begin(d); j < train_.End(d); ++j) {
+        int w = word_label_[train_.tok_[j]];
+        ++cnt[w];
+        if (best == -1 or cnt[w] > cnt[best] or (cnt[w] == cnt[best] and rarer(w, best))) {
+          best = w;
+        }
+      }
+      for (int j = train_.Begin(d); j < train_.End(d); ++j) {
+        cnt[word_label_[train_.tok_[j]]] = 0;
+      }
+      key[d] = (best == -1) ? num_word : best;
+    }
+  } else if (*sort_doc != "none") {
+    lg.Fatalf("unknown document order: %s", sort_doc->c_str());
+  }
+  std::vector<int> order(train_.num_doc_);
+  for (int d = 0; d < train_.num_doc_; ++d) {
+    order[d] = d;
+  }
+  std::stable_sort(RANGE(order), [&key](int a, int b) { return key[a] < key[b]; });
+  if (*sort_doc != "none") {
+    doc_origin_ = order;
+  }
+
+  // Tokens and assignments in the new order
+  Corpus sorted;
+  sorted.num_doc_ = train_.num_doc_;
+  sorted.num_token_ = train_.num_token_;
+  sorted.tok_.Init(train_.num_token_, num_word - 1);
+  sorted.asg_.Init(train_.num_token_, *num_topic - 1);
+  int j = 0;
+  for (int d : order) {
+    for (int i = train_.Begin(d); i < train_.End(d); ++i, ++j) {
+      sorted.tok_.Set(j, word_label_[train_.tok_[i]]);
+      sorted.asg_.Set(j, train_.asg_[i]);
+    }
+    sorted.offset_.push_back(j);
+  }
+  train_ = std::move(sorted);
+
+  // Rows in the new word order
+  SparseCount nkw;
+  nkw.Init(num_word, *num_topic, train_.MaxWordCount());
+  std::vector<SparseCount::CountPair> pair;
+  for (int w = 0; w < num_word; ++w) {
+    pair.clear();
+    for (auto p : nkw_.Row(origin[w])) {
+      pair.push_back(p);
+    }
+    nkw.Assign(w, pair.data(), pair.data() + pair.size());
+  }
+  nkw_ = std::move(nkw);
+  lg.Printf("relabeled %d words by frequency: %s, documents: %s",
+            num_word, *sort_vocab ? "yes" : "no", sort_doc->c_str());
+}
+
+int Trainer::word_label(int original) const { // words new to dict keep their ids
+  return (original < (int)word_label_.size()) ? word_label_[original] : original;
 }
 
-void Trainer::train_one_document(Document& doc) {
-  // Construct doc topic count on the fly to save memory
-  IArray nkd(*num_topic);
-  for (auto& pair : doc.body_) {
-    ++nkd(pair.asg_);
+// Online update of a checkpoint with the documents of train_file. The corpus
+// becomes the checkpoint's documents followed by the new ones, with the
+// checkpoint's counts kept. New tokens draw their first topic from the model,
+// p(k | w) = (nkw + beta) / (nk + beta_sum), and sweeps only sample the new
+// documents plus a uniform replay window of old ones. Both are moved to the
+// front of train_, save_result() restores the order.
+void Trainer::start_online(const ModelView& model) {
+  const auto& h = model.header_;
+  if (!(h.flags_ & MODEL_HAS_ASSIGNMENT)) {
+    lg.Fatalf("checkpoint has no assignments, save it with -dump_assignment true");
+  }
+  if (*sweep_order != "doc" or *sort_doc != "none") {
+    lg.Fatalf("-online supports the doc-order sweep in file order only");
+  }
+  Corpus fresh = std::move(train_);
+  int num_old = h.num_doc_;
+  int num_new = fresh.num_doc_;
+  int K = *num_topic;
+
+  // Replay window, Floyd's uniform sample of num_replay old documents
+  int num_replay = std::min<long long>(num_old, llround(*online_replay * num_new));
+  std::vector<char> replay(num_old, 0);
+  for (int i = num_old - num_replay; i < num_old; ++i) {
+    int d = Dice(i + 1);
+    replay[replay[d] ? i : d] = 1;
+  }
+  doc_origin_.clear(); // window, new documents, then the other old ones
+  for (int d = 0; d < num_old; ++d) {
+    if (replay[d]) {
+      doc_origin_.push_back(d);
+    }
+  }
+  for (int d = 0; d < num_new; ++d) {
+    doc_origin_.push_back(num_old + d);
+  }
+  for (int d = 0; d < num_old; ++d) {
+    if (!replay[d]) {
+      doc_origin_.push_back(d);
+    }
+  }
+  num_sample_doc_ = num_replay + num_new;
+
+  train_.offset_.assign(1, 0);
+  train_.num_doc_ = num_old + num_new;
+  train_.num_token_ = h.num_token_ + fresh.num_token_;
+  train_.tok_.Init(train_.num_token_, dict.size_ - 1);
+  train_.InitAssignment(K);
+  int j = 0;
+  for (int d : doc_origin_) {
+    if (d < num_old) {
+      for (int i = model.doc_offset_[d]; i < model.doc_offset_[d + 1]; ++i, ++j) {
+        train_.tok_.Set(j, model.tok_[i]);
+        train_.asg_.Set(j, model.asg_[i]);
+      }
+    } else {
+      for (int i = fresh.Begin(d - num_old); i < fresh.End(d - num_old); ++i, ++j) {
+        train_.tok_.Set(j, fresh.tok_[i]);
+      }
+    }
+    train_.offset_.push_back(j);
+  }
+  num_train_doc_ = train_.num_doc_;
+  num_train_token_ = train_.num_token_;
+
+  // Checkpoint counts, a word may gather all its old and new tokens in one topic
+  nkw_.Init(dict.size_, K, train_.MaxWordCount());
+  for (int w = 0; w < h.num_word_; ++w) {
+    nkw_.Assign(w, model.RowBegin(w), model.RowEnd(w));
   }
+  nk_ = Eigen::Map<const IArray>(model.nk_, K);
+  start_iter_ = h.num_iter_;
 
-  // Compute cached values
-  EArray denom = EREAL(nk_) + beta_sum_;
-  real r_sum = (alpha_ / denom).sum() * beta_;
-  real s_sum = 0.0;
-  EArray t_coeff = (EREAL(nkd) + alpha_) / denom;
-  std::list<int> nkd_index; // sorted, exploit sparsity, O(1) insert/erase
+  // First topics of the new tokens, the smoothing part from an F+tree
+  real beta = h.beta_;
+  real beta_sum = h.beta_sum_ + beta * (dict.size_ - h.num_word_);
+  EArray smooth = beta / (EREAL(nk_) + beta_sum);
+  FTree smooth_tree;
+  smooth_tree.Build(smooth.data(), K);
+  std::vector<real> cumsum;
+  for (int j = train_.Begin(num_replay); j < train_.Begin(num_sample_doc_); ++j) {
+    int word_id = train_.tok_[j];
+    auto word = nkw_.Row(word_id);
+    cumsum.resize(word.size());
+    real sum = 0.0;
+    for (int i = 0; i < word.size(); ++i) {
+      auto pair = word[i];
+      sum += pair.cnt_ / (nk_(pair.top_) + beta_sum);
+      cumsum[i] = sum;
+    }
+    real u = Unif01() * (sum + smooth_tree.Sum());
+    int topic = (u < sum)
+                ? word[std::lower_bound(RANGE(cumsum), u) - cumsum.begin()].top_
+                : smooth_tree.Sample(std::min(u - sum, smooth_tree.Sum()));
+    train_.asg_.Set(j, topic);
+    nkw_.AddCount(word_id, topic);
+    ++nk_(topic);
+    smooth_tree.Set(topic, beta / (nk_(topic) + beta_sum));
+  }
+  lg.Printf("online update of %s after %d iterations: %d new documents, %d new words, %d replayed",
+            resume_from->c_str(), start_iter_, num_new, dict.size_ - (int)h.num_word_, num_replay);
+}
+
+void Trainer::build_lgamma_table() {
+  lgamma_alpha_.resize((size_t)*num_topic * LGAMMA_TABLE);
   for (int k = 0; k < *num_topic; ++k) {
-    int cnt = nkd(k);
-    if (cnt != 0) {
-      nkd_index.push_back(k);
-      s_sum += cnt / denom(k);
+    double *row = lgamma_alpha_.data() + (size_t)k * LGAMMA_TABLE;
+    for (int n = 0; n < LGAMMA_TABLE; ++n) {
+      row[n] = LogGamma(n + (double)alpha_(k)) - LogGamma((double)alpha_(k));
+    }
+  }
+  lgamma_beta_.resize(LGAMMA_TABLE);
+  for (int n = 0; n < LGAMMA_TABLE; ++n) {
+    lgamma_beta_[n] = LogGamma(n + (double)beta_) - LogGamma((double)beta_);
+  }
+}
+
+void Trainer::build_word_major_index() {
+  // Counting sort of all tokens by word id
+  word_offset_.assign(dict.size_ + 1, 0);
+  for (int j = 0; j < train_.num_token_; ++j) {
+    ++word_offset_[train_.tok_[j] + 1];
+  }
+  for (int w = 0; w < dict.size_; ++w) {
+    word_offset_[w + 1] += word_offset_[w];
+  }
+  std::vector<int> next(word_offset_.begin(), word_offset_.end() - 1);
+  doc_slot_.resize(train_.num_token_);
+  slot_topic_.resize(train_.num_token_);
+  for (int j = 0; j < train_.num_token_; ++j) {
+    int slot = next[train_.tok_[j]]++;
+    doc_slot_[j] = slot;
+    slot_topic_[slot] = train_.asg_[j];
+  }
+  slot_proposal_ = slot_topic_; // first doc phase proposes nothing
+  word_nkw_.setZero(*num_topic);
+}
+
+void Trainer::partition_documents() {
+  // Split documents into contiguous ranges of roughly equal token count
+  int num_doc = (num_sample_doc_ < 0) ? train_.num_doc_ : num_sample_doc_;
+  int num_worker = std::max(1, std::min(*num_thread, num_doc));
+  if (sweep_order_ == SWEEP_WORD and num_worker > 1) {
+    lg.Printf("word-major sweep is single threaded, ignoring -num_thread");
+    num_worker = 1;
+  }
+  worker_.resize(num_worker);
+  long long token_sum = 0;
+  int doc = 0;
+  for (int t = 0; t < num_worker; ++t) {
+    worker_[t].doc_begin_ = doc;
+    long long token_end = (long long)train_.Begin(num_doc) * (t + 1) / num_worker;
+    while (doc < num_doc and token_sum < token_end) {
+      token_sum += train_.Length(doc);
+      ++doc;
+    }
+    worker_[t].doc_end_ = (t == num_worker - 1) ? num_doc : doc;
+    worker_[t].nkd_.setZero(*num_topic);
+    if (sampler_ == SAMPLER_ALIAS and sweep_order_ == SWEEP_DOC) { // the word sweep has no tables
+      worker_[t].word_alias_.resize(dict.size_);
+    }
+  }
+}
+
+void Trainer::build_word_blocks() {
+  // Sort the tokens of every document by word, so the tokens of one block
+  // form a single run, then split the vocabulary into word id ranges of
+  // roughly equal token count, one per worker
+  Timer block_timer("build_word_blocks");
+  auto& tok = train_.tok_;
+  auto& asg = train_.asg_;
+  int num_word = nkw_.NumWord();
+  NarrowArray sorted; // tok_ may be a read-only view of the cache
+  sorted.Init(train_.num_token_, num_word - 1);
+  std::vector<long long> freq(num_word, 0);
+  std::vector<long long> pair; // word << 32 | topic, one document
+  for (int d = 0; d < train_.num_doc_; ++d) {
+    pair.clear();
+    for (int j = train_.Begin(d); j < train_.End(d); ++j) {
+      pair.push_back((long long)tok[j] << 32 | asg[j]);
+      ++freq[tok[j]];
+    }
+    std::sort(RANGE(pair));
+    int j = train_.Begin(d);
+    for (long long p : pair) {
+      sorted.Set(j, p >> 32);
+      asg.Set(j, p & 0xffffffffLL);
+      ++j;
+    }
+  }
+  file_tok_ = std::move(train_.tok_); // may view cache_, which stays mapped
+  train_.tok_ = std::move(sorted);
+
+  int num_block = worker_.size();
+  block_begin_.assign(1, 0);
+  long long token_sum = 0;
+  for (int w = 0; w < num_word; ++w) {
+    token_sum += freq[w];
+    int b = block_begin_.size();
+    if (b < num_block and token_sum * num_block >= (long long)train_.num_token_ * b) {
+      block_begin_.push_back(w + 1);
+    }
+  }
+  block_begin_.resize(num_block + 1, num_word);
+  lg.Printf("model parallel with %d word blocks", num_block);
+}
+
+// Undo the sort of build_word_blocks() before the corpus is saved. Within
+// a document the i-th token of a word in file order takes the topic of the
+// i-th sorted token of that word, which sampled from the same conditional.
+void Trainer::unsort_word_blocks() {
+  NarrowArray asg;
+  asg.Init(train_.num_token_, *num_topic - 1);
+  std::vector<int> position;
+  for (int d = 0; d < train_.num_doc_; ++d) {
+    position.clear();
+    for (int j = train_.Begin(d); j < train_.End(d); ++j) {
+      position.push_back(j);
+    }
+    std::stable_sort(RANGE(position), [this](int a, int b) { return file_tok_[a] < file_tok_[b]; });
+    for (size_t i = 0; i < position.size(); ++i) {
+      asg.Set(position[i], train_.asg_[train_.Begin(d) + i]);
+    }
+  }
+  train_.tok_ = std::move(file_tok_);
+  train_.asg_ = std::move(asg);
+  file_tok_ = NarrowArray();
+}
+
+int Trainer::lower_token(int d, int word_id) const {
+  // First token of document d with a word id not less than word_id
+  int lo = train_.Begin(d), hi = train_.End(d);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (train_.tok_[mid] < word_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+void Trainer::sweep(int iter) {
+  if (sweep_order_ == SWEEP_WORD) {
+    doc_phase();
+    word_phase();
+    for (int j = 0; j < train_.num_token_; ++j) { // publish for evaluation
+      train_.asg_.Set(j, slot_topic_[doc_slot_[j]]);
+    }
+    return;
+  }
+  int num_batch = std::max(1, stream_.NumBatch());
+  for_each_batch(true, [this, iter, num_batch](int b) {
+    if (*stream_file != "") { // documents change with every minibatch
+      partition_documents();
+    }
+    int seed = iter * num_batch + b;
+    if (parallel_ == PARALLEL_MODEL and worker_.size() > 1) {
+      sample_blocks(seed);
+    } else {
+      sample_documents(seed);
+    }
+  });
+}
+
+void Trainer::sample_documents(int seed) {
+  int num_worker = worker_.size();
+  if (num_worker == 1) { // sample the shared counts in place
+    auto& worker = worker_[0];
+    worker.nkw_ = &nkw_;
+    worker.nk_.swap(nk_);
+    worker.stream_ = seed;
+    reset_buckets(worker);
+    for (int d = worker.doc_begin_; d < worker.doc_end_; ++d) {
+      sample_one_document(d, train_.Begin(d), train_.End(d), worker);
+    }
+    worker.nk_.swap(nk_);
+    return;
+  }
+
+  std::string parent = Profiler::path();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_worker; ++t) {
+    threads.emplace_back([this, seed, t, num_worker, &parent]() {
+      Zone zone("sample_worker", parent);
+      auto& worker = worker_[t];
+      worker.local_nkw_ = nkw_; // stale copy of the shared counts
+      worker.nkw_ = &worker.local_nkw_;
+      worker.nk_ = nk_;
+      worker.stream_ = seed; // draws do not depend on the thread count
+      reset_buckets(worker);
+      for (int d = worker.doc_begin_; d < worker.doc_end_; ++d) {
+        sample_one_document(d, train_.Begin(d), train_.End(d), worker);
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  merge_workers();
+}
+
+// Model-parallel sweep in the style of LightLDA and Petuum. Documents are
+// split into one shard per worker and words into as many blocks. In round r
+// worker t samples the tokens of block (t + r) % W in shard t, so no nkw row
+// or document is touched by two workers at once and the shared rows are
+// updated in place. Only nk is private, it is reconciled after every round.
+void Trainer::sample_blocks(int seed) {
+  int num_worker = worker_.size();
+  std::string parent = Profiler::path();
+  for (int round = 0; round < num_worker; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_worker; ++t) {
+      threads.emplace_back([this, seed, round, t, num_worker, &parent]() {
+        Zone zone("sample_block", parent);
+        auto& worker = worker_[t];
+        worker.nkw_ = &nkw_;
+        worker.nk_ = nk_;
+        worker.stream_ = (uint64_t)seed * num_worker + round;
+        reset_buckets(worker);
+        int block = (t + round) % num_worker;
+        for (int d = worker.doc_begin_; d < worker.doc_end_; ++d) {
+          int first = lower_token(d, block_begin_[block]);
+          int last = lower_token(d, block_begin_[block + 1]);
+          if (first < last) {
+            sample_one_document(d, first, last, worker);
+          }
+        }
+      });
+    }
+    for (auto& th : threads) {
+      th.join();
+    }
+    merge_topic_counts();
+  }
+}
+
+// Word-major sweep in the style of WarpLDA. Every token keeps its topic and
+// one pending proposal in word-major order. The doc phase accepts word
+// proposals and draws doc proposals, the word phase does the opposite, so
+// each phase only needs the counts of the document or word at hand. nkw_ is
+// not touched in the doc phase and is rebuilt row by row in the word phase,
+// where the row and all tokens of the word are contiguous.
+void Trainer::doc_phase() {
+  auto& nkd = worker_[0].nkd_;
+  for (int d = 0; d < train_.num_doc_; ++d) {
+    int nd = train_.Length(d);
+    const int *slot = doc_slot_.data() + train_.Begin(d);
+    for (int n = 0; n < nd; ++n) {
+      ++nkd(slot_topic_[slot[n]]);
     }
+
+    // Accept word proposals, q = nkw + beta cancels against the target
+    for (int n = 0; n < nd; ++n) {
+      int old_topic = slot_topic_[slot[n]];
+      int new_topic = slot_proposal_[slot[n]];
+      if (new_topic == old_topic) {
+        continue;
+      }
+      real pi = (nkd(new_topic) + alpha_(new_topic))
+                * (nk_(old_topic) - 1 + beta_sum_)
+                / ((nkd(old_topic) - 1 + alpha_(old_topic))
+                   * (nk_(new_topic) + beta_sum_));
+      if (Unif01() < pi) {
+        --nkd(old_topic);
+        ++nkd(new_topic);
+        --nk_(old_topic);
+        ++nk_(new_topic);
+        slot_topic_[slot[n]] = new_topic;
+      }
+    }
+
+    // Draw doc proposals, q = nkd + alpha
+    for (int n = 0; n < nd; ++n) {
+      real u = Unif01() * (nd + alpha_sum_);
+      slot_proposal_[slot[n]] = (u < nd)
+                                ? slot_topic_[slot[(int)u]]
+                                : alpha_alias_.Draw((u - nd) / alpha_sum_);
+    }
+    for (int n = 0; n < nd; ++n) {
+      nkd(slot_topic_[slot[n]]) = 0;
+    }
+  } // end of iter over docs
+}
+
+void Trainer::word_phase() {
+  auto& cnt = word_nkw_; // dense row of the current word
+  for (int w = 0; w < dict.size_; ++w) {
+    int begin = word_offset_[w];
+    int nw = word_offset_[w + 1] - begin;
+    int *topic = slot_topic_.data() + begin;
+    int *proposal = slot_proposal_.data() + begin;
+    for (int i = 0; i < nw; ++i) {
+      ++cnt(topic[i]);
+    }
+
+    // Accept doc proposals, q = nkd + alpha cancels against the target
+    for (int i = 0; i < nw; ++i) {
+      int old_topic = topic[i];
+      int new_topic = proposal[i];
+      if (new_topic == old_topic) {
+        continue;
+      }
+      real pi = (cnt(new_topic) + beta_) * (nk_(old_topic) - 1 + beta_sum_)
+                / ((cnt(old_topic) - 1 + beta_) * (nk_(new_topic) + beta_sum_));
+      if (Unif01() < pi) {
+        --cnt(old_topic);
+        ++cnt(new_topic);
+        --nk_(old_topic);
+        ++nk_(new_topic);
+        topic[i] = new_topic;
+      }
+    }
+
+    // Draw word proposals, q = nkw + beta
+    real smooth = *num_topic * beta_;
+    for (int i = 0; i < nw; ++i) {
+      real u = Unif01() * (nw + smooth);
+      proposal[i] = (u < nw) ? topic[(int)u] : Dice(*num_topic);
+    }
+
+    // Write back the row, leave cnt zeroed for the next word
+    auto& pair = word_pair_;
+    pair.clear();
+    for (int i = 0; i < nw; ++i) {
+      int k = topic[i];
+      if (cnt(k) != 0) {
+        pair.emplace_back(k, cnt(k));
+        cnt(k) = 0;
+      }
+    }
+    nkw_.Assign(w, pair.data(), pair.data() + pair.size());
+    nkw_.Sort(w);
+  } // end of iter over words
+}
+
+void Trainer::reset_buckets(Worker& worker) {
+  if (sampler_ != SAMPLER_SPARSE) {
+    return;
+  }
+  // O(K) once per sweep, documents then only touch their own topics
+  worker.denom_ = EREAL(worker.nk_) + beta_sum_;
+  worker.t_coeff_ = alpha_ / worker.denom_;
+  EArray r = alpha_ * beta_ / worker.denom_;
+  worker.r_tree_.Build(r.data(), *num_topic);
+  r.setZero();
+  worker.s_tree_.Build(r.data(), *num_topic);
+}
+
+void Trainer::merge_topic_counts() {
+  // New counts are old counts plus the sum of every worker's delta
+  int num_worker = worker_.size();
+  IArray nk = -(num_worker - 1) * nk_;
+  for (const auto& worker : worker_) {
+    nk += worker.nk_;
+  }
+  nk_ = nk;
+}
+
+void Trainer::merge_workers() {
+  Zone zone("merge_workers");
+  merge_topic_counts();
+  int num_worker = worker_.size();
+
+  // Rows are merged and sorted in parallel, then stored serially since the
+  // row pool is not thread safe
+  std::vector<std::vector<SparseCount::CountPair>> merged(num_worker);
+  std::vector<std::vector<int>> merged_size(num_worker);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_worker; ++t) {
+    threads.emplace_back([this, t, num_worker, &merged, &merged_size]() {
+      IArray acc = IArray::Zero(*num_topic);
+      std::vector<int> stamp(*num_topic, -1), touched;
+      auto& item = merged[t];
+      for (int w = t; w < nkw_.NumWord(); w += num_worker) { // interleave
+        touched.clear();
+        auto collect = [&](const SparseCount& table, int weight) {
+          for (auto pair : table.Row(w)) {
+            if (stamp[pair.top_] != w) {
+              stamp[pair.top_] = w;
+              touched.push_back(pair.top_);
+            }
+            acc(pair.top_) += weight * pair.cnt_;
+          }
+        };
+        collect(nkw_, -(num_worker - 1));
+        for (const auto& worker : worker_) {
+          collect(worker.local_nkw_, 1);
+        }
+        size_t row_begin = item.size();
+        for (int k : touched) {
+          if (acc(k) > 0) {
+            item.emplace_back(k, acc(k));
+          }
+          acc(k) = 0;
+        }
+        std::sort(item.begin() + row_begin, item.end(),
+                  [](SparseCount::CountPair a, SparseCount::CountPair b){ return a.cnt_ > b.cnt_; });
+        merged_size[t].push_back(item.size() - row_begin);
+      }
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
   }
-  s_sum *= beta_;
+  for (int t = 0; t < num_worker; ++t) {
+    const auto *pair = merged[t].data();
+    int i = 0;
+    for (int w = t; w < nkw_.NumWord(); w += num_worker) {
+      int size = merged_size[t][i++];
+      nkw_.Assign(w, pair, pair + size);
+      pair += size;
+    }
+  }
+}
 
-  // Construct dist
-  EArray t_cumsum(*num_topic); // only access first nkw_size entries
-  for (int n = 0; n < (int)doc.body_.size(); ++n) {
+// Pick the instantiation of the SparseLDA kernels for this run. Topics are
+// stored in 1, 2 or 4 bytes and nkw entries in 4 or 8, as decided by K and
+// the corpus. When K is in (KMAX / 2, KMAX] for KMAX of 64, 128 or 256, the
+// F+trees and the nkw topic bits also have a compile-time size. The vector
+// kernels of simd.h are picked for the CPU at hand.
+void Trainer::select_kernels() {
+  if (!Simd::Init(*simd)) {
+    lg.Fatalf("unknown or unsupported -simd %s", simd->c_str());
+  }
+  int K = *num_topic;
+  int k_class = 0;
+  for (int kmax : {64, 128, 256}) {
+    if (*fixed_k and kmax / 2 < K and K <= kmax) {
+      k_class = kmax;
+    }
+  }
+  int asg_width = NarrowArray::WidthFor(K - 1);
+  if (nkw_.width_ == 4) {
+    select_kernels<uint32_t>(asg_width, k_class);
+  } else {
+    select_kernels<uint64_t>(asg_width, k_class);
+  }
+  if (sampler_ == SAMPLER_SPARSE) {
+    lg.Printf("sampler kernel: %d-byte topics, %d-byte entries, K class %s, %s rows",
+              asg_width, nkw_.width_, k_class ? std::to_string(k_class).c_str() : "dynamic",
+              Simd::Name());
+  }
+}
+
+template <typename Entry>
+void Trainer::select_kernels(int asg_width, int k_class) {
+  switch (k_class) { // topics fit in one byte
+    case 64:  use_kernels<uint8_t, Entry, 64>(); return;
+    case 128: use_kernels<uint8_t, Entry, 128>(); return;
+    case 256: use_kernels<uint8_t, Entry, 256>(); return;
+  }
+  switch (asg_width) {
+    case 1:  use_kernels<uint8_t, Entry, 0>(); break;
+    case 2:  use_kernels<uint16_t, Entry, 0>(); break;
+    default: use_kernels<uint32_t, Entry, 0>(); break;
+  }
+}
+
+template <typename Asg, typename Entry, int KMAX>
+void Trainer::use_kernels() {
+  train_kernel_ = &Trainer::train_one_document<Asg, Entry, KMAX>;
+  test_kernel_ = &Trainer::test_one_document<Asg, Entry, KMAX>;
+}
+
+// Sample tokens [first, last) of document d, which may be a part of it.
+// Their uniforms come from the Philox stream of the sweep and document, in
+// one batch ahead of the token loop.
+void Trainer::sample_one_document(int d, int first, int last, Worker& worker) {
+  int per_token = (sampler_ == SAMPLER_ALIAS) ? 2 * *mh_step : 1;
+  worker.uniform_.resize((size_t)(last - first) * per_token);
+  Philox rng((uint32_t)*seed, worker.stream_ << 32 | (uint32_t)d);
+  rng.Fill(worker.uniform_.data(), worker.uniform_.size());
+  if (sampler_ == SAMPLER_ALIAS) {
+    train_one_document_alias(d, first, last, worker);
+  } else {
+    (this->*train_kernel_)(d, first, last, worker);
+  }
+}
+
+// SparseLDA kernel, see select_kernels() for the template arguments
+template <typename Asg, typename Entry, int KMAX>
+void Trainer::train_one_document(int d, int first, int last, Worker& worker) {
+  auto& nkw = *worker.nkw_; // sample against the worker's view of the counts
+  int *nk = worker.nk_.data();
+  const auto& tok = train_.tok_;
+  Asg *asg = train_.asg_.Typed<Asg>();
+  const real *alpha = alpha_.data();
+  const real beta = beta_, beta_sum = beta_sum_;
+  const int shift = (sizeof(Entry) == 8) ? 32 : KMAX ? FTree::log2_of(KMAX) : nkw.shift_;
+  const Entry mask = ((Entry)1 << shift) - 1; // topic bits of an entry
+  int begin = train_.Begin(d);
+  int end = train_.End(d);
+
+  // Construct doc topic count on the fly to save memory, nkd is zero and
+  // t_coeff is alpha / denom between docs, so setup is O(doc length)
+  int *nkd = worker.nkd_.data();
+  real *denom = worker.denom_.data(); // nk + beta_sum, kept across docs
+  real *t_coeff = worker.t_coeff_.data();
+  auto& r_tree = worker.r_tree_; // alpha * beta / denom, kept across docs
+  auto& s_tree = worker.s_tree_; // nkd * beta / denom, zero between docs
+  auto& t_cumsum = worker.t_cumsum_; // only access first nkw_size entries
+  const float *uniform = worker.uniform_.data(); // one per token
+  METRIC(++worker.metrics_.doc_);
+  for (int j = begin; j < end; ++j) {
+    ++nkd[asg[j]];
+    METRIC(worker.metrics_.doc_topic_sum_ += (nkd[asg[j]] == 1));
+  }
+  for (int j = begin; j < end; ++j) {
+    int k = asg[j];
+    s_tree.Set<KMAX>(k, nkd[k] * beta / denom[k]);
+    t_coeff[k] = (nkd[k] + alpha[k]) / denom[k];
+  }
+
+  for (int j = first; j < last; ++j) {
     // Localize
-    int word_id   = doc.body_[n].tok_;
-    int old_topic = doc.body_[n].asg_;
-    auto& word = nkw_[word_id]; // sparse word
-    int nkw_size = word.item_.size();
+    int word_id   = tok[j];
+    int old_topic = asg[j];
+    auto word = nkw.Row(word_id); // sparse word
+    const Entry *entry = reinterpret_cast<const Entry*>(word.data_);
+    int nkw_size = word.size();
+    METRIC(++worker.metrics_.token_);
+    METRIC(worker.metrics_.row_size_sum_ += nkw_size);
+    METRIC(worker.metrics_.row_size_max_ = std::max<long long>(worker.metrics_.row_size_max_, nkw_size));
 
     // Decrement
-    real nk_betasum = nk_(old_topic) + beta_sum_;
-    int cnt = nkd(old_topic);
-    r_sum -= alpha_(old_topic) * beta_ / nk_betasum;
-    s_sum -= cnt * beta_ / nk_betasum;
-    --nkd(old_topic);
-    --cnt;
-    if (cnt == 0) { // shrink index
-      auto pos = std::lower_bound(RANGE(nkd_index), old_topic);
-      nkd_index.erase(pos);
-    }
-    --nk_(old_topic);
-    --nk_betasum;
-    r_sum += alpha_(old_topic) * beta_ / nk_betasum;
-    s_sum += cnt * beta_ / nk_betasum;
-    t_coeff(old_topic) = (cnt + alpha_(old_topic)) / nk_betasum;
+    int cnt = --nkd[old_topic];
+    real nk_betasum = denom[old_topic] = --nk[old_topic] + beta_sum;
+    r_tree.Set<KMAX>(old_topic, alpha[old_topic] * beta / nk_betasum);
+    s_tree.Set<KMAX>(old_topic, cnt * beta / nk_betasum);
+    t_coeff[old_topic] = (cnt + alpha[old_topic]) / nk_betasum;
 
     // Taking advantage of sparsity
-    real t_sum = 0.0;
-    t_cumsum.setZero();
-    for (int i = 0; i < nkw_size; ++i) {
-      auto pair = word.item_[i];
-      int nkw_val = (pair.top_ == old_topic) ? pair.cnt_ - 1 : pair.cnt_;
-      t_sum += t_coeff(pair.top_) * nkw_val;
-      t_cumsum(i) = t_sum;
+    if ((int)t_cumsum.size() < nkw_size) {
+      t_cumsum.resize(nkw_size);
     }
+    real *t_head = t_cumsum.data();
+    real t_sum = Simd::PrefixSum(entry, nkw_size, shift, t_coeff, old_topic, 0.0f, t_head);
 
     // Draw
-    real u = Unif01() * (r_sum + s_sum + t_sum);
+    real r_sum = r_tree.Sum();
+    real s_sum = s_tree.Sum();
+    real u = uniform[j - first] * (r_sum + s_sum + t_sum);
     int new_topic = -1;
     if (u < t_sum) { // binary search on t_cumsum
-      real *t_head = t_cumsum.data();
-      int index = std::lower_bound(t_head, t_head + nkw_size, u) - t_head;
-      new_topic = word.item_[index].top_;
+      int index = Simd::LowerBound(t_head, nkw_size, u);
+      new_topic = entry[index] & mask;
+      METRIC(++worker.metrics_.draw_t_);
     } // end of t bucket
     else {
       u -= t_sum;
-      if (u < s_sum) { // make use of sparsity in nkd
-        u /= beta_;
-        new_topic = nkd_index.back(); // numerical reasons
-        for (int k : nkd_index) {
-          u -= nkd(k) / (nk_(k) + beta_sum_);
-          if (u <= 0.0) {
-            new_topic = k;
-            break;
-          }
-        }
+      if (u < s_sum) { // descend the doc-specific tree
+        new_topic = s_tree.Sample<KMAX>(u);
+        METRIC(++worker.metrics_.draw_s_);
       } // end of s bucket
-      else { // linear serach
-        u -= s_sum;
-        u /= beta_;
-        new_topic = nkd_index.back(); // numerical reasons
-        for (int k = 0; k < *num_topic; ++k) {
-          u -= alpha_(k) / (nk_(k) + beta_sum_);
-          if (u <= 0.0) {
-            new_topic = k;
-            break;
-          }
-        }
+      else { // descend the smoothing tree
+        new_topic = r_tree.Sample<KMAX>(std::min(u - s_sum, r_sum));
+        METRIC(++worker.metrics_.draw_r_);
       } // end of r bucket
     }
-    
+
     // Increment
-    nk_betasum = nk_(new_topic) + beta_sum_;
-    cnt = nkd(new_topic);
-    r_sum -= alpha_(new_topic) * beta_ / nk_betasum;
-    s_sum -= cnt * beta_ / nk_betasum;
-    ++nkd(new_topic);
-    ++cnt;
-    if (cnt == 1) { // augment index
-      auto pos = std::lower_bound(RANGE(nkd_index), new_topic);
-      nkd_index.insert(pos, new_topic);
-    }
-    ++nk_(new_topic);
-    ++nk_betasum;
-    r_sum += alpha_(new_topic) * beta_ / nk_betasum;
-    s_sum += cnt * beta_ / nk_betasum;
-    t_coeff(new_topic) = (cnt + alpha_(new_topic)) / nk_betasum;
+    cnt = ++nkd[new_topic];
+    nk_betasum = denom[new_topic] = ++nk[new_topic] + beta_sum;
+    r_tree.Set<KMAX>(new_topic, alpha[new_topic] * beta / nk_betasum);
+    s_tree.Set<KMAX>(new_topic, cnt * beta / nk_betasum);
+    t_coeff[new_topic] = (cnt + alpha[new_topic]) / nk_betasum;
 
     // Set
     if (new_topic != old_topic) {
-      doc.body_[n].asg_ = new_topic;
-      word.UpdateCount(old_topic, new_topic);
+      METRIC(++worker.metrics_.changed_);
+      asg[j] = new_topic;
+      nkw.UpdateCount(word_id, old_topic, new_topic);
+    }
+  } // end of iter over tokens
+
+  for (int j = begin; j < end; ++j) { // leave the doc terms empty for the next doc
+    int k = asg[j];
+    nkd[k] = 0;
+    s_tree.Set<KMAX>(k, 0.0);
+    t_coeff[k] = alpha[k] / denom[k];
+  }
+}
+
+void Trainer::build_word_alias(Worker& worker, int word_id) {
+  auto word = worker.nkw_->Row(word_id);
+  int nkw_size = word.size();
+  auto& topic = worker.alias_topic_;
+  auto& weight = worker.alias_weight_;
+  topic.resize(nkw_size);
+  weight.resize(nkw_size);
+  for (int i = 0; i < nkw_size; ++i) {
+    auto pair = word[i];
+    topic[i] = pair.top_;
+    weight[i] = pair.cnt_ / (worker.nk_(topic[i]) + beta_sum_);
+  }
+  worker.word_alias_[word_id].Build(topic.data(), weight.data(), nkw_size);
+}
+
+void Trainer::build_dense_alias(Worker& worker) {
+  auto& topic = worker.alias_topic_;
+  auto& weight = worker.alias_weight_;
+  topic.resize(*num_topic);
+  weight.resize(*num_topic);
+  for (int k = 0; k < *num_topic; ++k) {
+    topic[k] = k;
+    weight[k] = beta_ / (worker.nk_(k) + beta_sum_);
+  }
+  worker.dense_alias_.Build(topic.data(), weight.data(), *num_topic);
+}
+
+// Metropolis-Hastings sampler in the style of LightLDA. Word proposals
+// (nkw + beta) / (nk + beta_sum) come from a sparse per-word alias table
+// mixed with a dense table shared by all words, doc proposals nkd + alpha
+// pick the topic of a random token in the document. Both are cycled and
+// corrected by MH acceptance against the current counts, so the cost per
+// token does not grow with K.
+void Trainer::train_one_document_alias(int d, int first, int last, Worker& worker) {
+  auto& nkw = *worker.nkw_;
+  auto& nk = worker.nk_;
+  auto& nkd = worker.nkd_;
+  auto& tok = train_.tok_;
+  auto& asg = train_.asg_;
+  int begin = train_.Begin(d);
+  int end = train_.End(d);
+  int nd = end - begin;
+  METRIC(++worker.metrics_.doc_);
+  for (int j = begin; j < end; ++j) {
+    ++nkd(asg[j]);
+    METRIC(worker.metrics_.doc_topic_sum_ += (nkd(asg[j]) == 1));
+  }
+
+  for (int j = first; j < last; ++j) {
+    // Localize
+    int word_id   = tok[j];
+    int old_topic = asg[j];
+    auto& word_alias = worker.word_alias_[word_id];
+    auto& dense_alias = worker.dense_alias_;
+    if (word_alias.Stale()) { // rebuild lazily, amortized O(1)
+      build_word_alias(worker, word_id);
+    }
+    if (dense_alias.Stale()) {
+      build_dense_alias(worker);
+    }
+
+    // Unnormalized target excluding the current token
+    auto target = [&](int k, int nkw_val) {
+      int self = (k == old_topic);
+      return (nkd(k) - self + alpha_(k)) * (nkw_val - self + beta_)
+             / (nk(k) - self + beta_sum_);
+    };
+
+    int topic = old_topic;
+    int topic_nkw = nkw.Count(word_id, topic);
+    const float *u_step = worker.uniform_.data() + (size_t)(j - first) * 2 * *mh_step;
+    METRIC(++worker.metrics_.token_);
+    METRIC(worker.metrics_.row_size_sum_ += nkw.Size(word_id));
+    METRIC(worker.metrics_.row_size_max_ = std::max<long long>(worker.metrics_.row_size_max_, nkw.Size(word_id)));
+    for (int step = 0; step < *mh_step; ++step) {
+      // Propose
+      int proposal;
+      bool word_step = (step % 2 == 0);
+      if (word_step) {
+        real mass = word_alias.mass_ + dense_alias.mass_;
+        real u = u_step[2 * step] * mass;
+        proposal = (u < word_alias.mass_)
+                   ? word_alias.Draw(u / word_alias.mass_)
+                   : dense_alias.Draw((u - word_alias.mass_) / dense_alias.mass_);
+      } else {
+        real u = u_step[2 * step] * (nd + alpha_sum_);
+        proposal = (u < nd)
+                   ? asg[begin + (int)u]
+                   : alpha_alias_.Draw((u - nd) / alpha_sum_);
+      }
+      if (proposal == topic) {
+        continue;
+      }
+      METRIC(++worker.metrics_.mh_propose_);
+
+      // Accept or reject
+      int proposal_nkw = nkw.Count(word_id, proposal);
+      real pi_old = target(topic, topic_nkw);
+      real pi_new = target(proposal, proposal_nkw);
+      real q_old, q_new;
+      if (word_step) {
+        q_old = (topic_nkw + beta_) / (nk(topic) + beta_sum_);
+        q_new = (proposal_nkw + beta_) / (nk(proposal) + beta_sum_);
+      } else {
+        q_old = nkd(topic) + alpha_(topic);
+        q_new = nkd(proposal) + alpha_(proposal);
+      }
+      if (u_step[2 * step + 1] * pi_old * q_new < pi_new * q_old) {
+        topic = proposal;
+        topic_nkw = proposal_nkw;
+        METRIC(++worker.metrics_.mh_accept_);
+      }
+    }
+
+    // Set
+    if (topic != old_topic) {
+      METRIC(++worker.metrics_.changed_);
+      --nkd(old_topic);
+      ++nkd(topic);
+      --nk(old_topic);
+      ++nk(topic);
+      nkw.UpdateCount(word_id, old_topic, topic);
+      asg.Set(j, topic);
     }
   } // end of iter over tokens
+
+  for (int j = begin; j < end; ++j) { // leave nkd zeroed for the next doc
+    nkd(asg[j]) = 0;
+  }
 }
 
 /*
@@ -287,112 +1343,449 @@ void Trainer1::PrintPerplexity() {
 }
 */
 
-real Trainer::evaluate_joint() {
-  real doc_llh = 0.0;
-  IArray nkd(*num_topic);
-  for (const auto& doc : train_.corpus_) {
-    nkd.setZero();
-    for (const auto& pair : doc.body_) {
-      ++nkd(pair.asg_);
-    }
-    for (int k = 0; k < *num_topic; ++k) {
-      int cnt = nkd(k);
-      if (cnt != 0) {
-        doc_llh += lgamma(cnt + alpha_(k)) - lgamma(alpha_(k));
+// Hand the model after sweep iter to the evaluation, with the sampler
+// counters and mean sweep time since the last one. With -async_eval the job
+// gets a snapshot and is queued, sampling only waits when eval_backlog
+// snapshots are queued already.
+void Trainer::evaluate(int iter) {
+  EvalJob job;
+  job.iter_ = iter;
+  job.sec_ = eval_sweep_ ? eval_sec_ / eval_sweep_ : 0.0;
+  eval_sec_ = 0.0;
+  eval_sweep_ = 0;
+  job.worker_bytes_ = 0;
+  for (auto& worker : worker_) { // reset for the next evaluation
+    job.metrics_.Add(worker.metrics_);
+    worker.metrics_ = SamplerMetrics();
+    job.worker_bytes_ += worker.local_nkw_.Bytes();
+  }
+  if (!eval_thread_.joinable()) {
+    evaluate_job(job);
+    return;
+  }
+  {
+    Zone zone("snapshot");
+    job.snapshot_ = true;
+    job.nkw_ = nkw_;
+    job.nk_ = nk_;
+    job.asg_ = train_.asg_;
+  }
+  std::unique_lock<std::mutex> lock(eval_mutex_);
+  if ((int)eval_queue_.size() >= *eval_backlog) { // evaluation falls behind
+    Zone zone("eval_wait");
+    eval_cv_.wait(lock, [this]() { return (int)eval_queue_.size() < *eval_backlog; });
+  }
+  eval_queue_.push_back(std::move(job));
+  eval_cv_.notify_all();
+}
+
+void Trainer::evaluation_loop() {
+  SeedUnif01(*seed + 1); // own stream for the held-out fold-in
+  while (true) {
+    EvalJob job;
+    {
+      std::unique_lock<std::mutex> lock(eval_mutex_);
+      eval_cv_.wait(lock, [this]() { return !eval_queue_.empty() or eval_done_; });
+      if (eval_queue_.empty()) {
+        return;
       }
+      job = std::move(eval_queue_.front());
+      eval_queue_.pop_front();
     }
-    doc_llh -= lgamma(doc.body_.size() + alpha_sum_);
+    eval_cv_.notify_all(); // room for the next snapshot
+    evaluate_job(job);
   }
-  doc_llh += train_.num_doc_ * lgamma(alpha_sum_);
+}
 
-  real model_llh = 0.0;
-  for (int k = 0; k < *num_topic; ++k) {
-    model_llh -= lgamma(nk_(k) + beta_sum_);
-    model_llh += lgamma(beta_sum_);
+void Trainer::finish_evaluation() { // wait for the queued snapshots
+  if (!eval_thread_.joinable()) {
+    return;
   }
-  real nonzero_nkw = 0;
-  for (const auto& word : nkw_) {
-    nonzero_nkw += word.item_.size();
-    for (const auto& pair : word.item_)
-      model_llh += lgamma(pair.cnt_ + beta_);
+  {
+    std::lock_guard<std::mutex> guard(eval_mutex_);
+    eval_done_ = true;
   }
-  model_llh -= nonzero_nkw * lgamma(beta_);
+  eval_cv_.notify_all();
+  eval_thread_.join();
+}
 
-  return (doc_llh + model_llh) / (real)(train_.num_token_);
+void Trainer::evaluate_job(const EvalJob& job) {
+  Zone zone("evaluate");
+  const SparseCount& nkw = job.snapshot_ ? job.nkw_ : nkw_;
+  const IArray& nk = job.snapshot_ ? job.nk_ : nk_;
+  // Doc terms need the assignments, which may be streamed from disk
+  double joint_doc = 0.0, llh_doc = 0.0;
+  if (job.snapshot_) {
+    joint_doc = joint_doc_term(job.asg_);
+    llh_doc = llh_doc_term(nkw, nk, job.asg_);
+  } else {
+    for_each_batch(false, [this, &nkw, &nk, &joint_doc, &llh_doc](int) {
+      joint_doc += joint_doc_term(train_.asg_);
+      llh_doc += llh_doc_term(nkw, nk, train_.asg_);
+    });
+  }
+  iter_time_.push_back(job.sec_);
+  joint_.push_back(evaluate_joint(joint_doc, nkw, nk));
+  llh_.push_back(llh_doc / (real)(num_train_token_));
+  test_llh_.push_back(evaluate_test_llh(nkw, nk));
+  lg.Printf("%4d%12.4lf%12.4lf%12.4lf%12.4lf",
+            job.iter_, iter_time_.back(), joint_.back(), llh_.back(), test_llh_.back());
+  if (metrics_fp_ != NULL) {
+    write_metrics(job, nkw);
+  }
 }
 
-real Trainer::evaluate_llh() {
-  real llh = 0.0;
-  EArray denom = EREAL(nk_) + beta_sum_;
-  EArray cached_term(*num_topic);
-  for (const auto& doc : train_.corpus_) {
-    cached_term.setZero();
-    for (auto& pair : doc.body_) {
-      cached_term(pair.asg_) += 1;
-    }
-    cached_term = (cached_term + alpha_) / denom;
-    int nd = doc.body_.size();
-    for (int n = 0; n < nd; ++n) {
-      int word_id = doc.body_[n].tok_;
-      real s = (cached_term * (nkw_[word_id].Array(*num_topic) + beta_)).sum();
-      llh += log(s);
+void Trainer::write_metrics(const EvalJob& job, const SparseCount& nkw) {
+  double sec = iter_time_.back();
+  size_t corpus_bytes = (*stream_file != "") ? stream_.Bytes() : train_.Bytes(); // on disk when streaming
+  fprintf(metrics_fp_, "{\"iter\":%d,\"sec\":%.6g,\"token_per_sec\":%.6g,"
+                       "\"joint\":%.6g,\"llh\":%.6g,\"test_llh\":%.6g,"
+                       "\"nkw_bytes\":%zu,\"worker_nkw_bytes\":%zu,\"test_nkw_bytes\":%zu,"
+                       "\"corpus_bytes\":%zu,\"test_corpus_bytes\":%zu,\"dict_bytes\":%zu",
+          job.iter_, sec, (sec > 0) ? num_train_token_ / sec : 0.0,
+          joint_.back(), llh_.back(), test_llh_.back(),
+          nkw.Bytes(), job.worker_bytes_, test_nkw_.Bytes(),
+          corpus_bytes, test_.Bytes(), dict.Bytes());
+#ifdef METRICS
+  const SamplerMetrics& m = job.metrics_; // all workers since the last evaluation
+  double token = std::max(1LL, m.token_);
+  double draw = std::max(1LL, m.draw_r_ + m.draw_s_ + m.draw_t_);
+  fprintf(metrics_fp_, ",\"token\":%lld,\"changed\":%lld,"
+                       "\"r_frac\":%.4f,\"s_frac\":%.4f,\"t_frac\":%.4f,\"mh_accept\":%.4f,"
+                       "\"row_size_mean\":%.4g,\"row_size_max\":%lld,\"doc_topic_mean\":%.4g",
+          m.token_, m.changed_,
+          m.draw_r_ / draw, m.draw_s_ / draw, m.draw_t_ / draw,
+          (double)m.mh_accept_ / std::max(1LL, m.mh_propose_),
+          m.row_size_sum_ / token, m.row_size_max_,
+          (double)m.doc_topic_sum_ / std::max(1LL, m.doc_));
+#endif
+  fprintf(metrics_fp_, "}\n");
+  fflush(metrics_fp_);
+}
+
+double Trainer::joint_doc_term(const NarrowArray& asg) {
+  // Only nonzero counts contribute, lgamma(0 + x) - lgamma(x) = 0
+  int K = *num_topic;
+  return parallel_sum(train_.num_doc_, [this, &asg, K](int doc_begin, int doc_end) {
+    IArray nkd = IArray::Zero(K);
+    double llh = 0.0;
+    for (int d = doc_begin; d < doc_end; ++d) {
+      int begin = train_.Begin(d);
+      int end = train_.End(d);
+      for (int j = begin; j < end; ++j) {
+        ++nkd(asg[j]);
+      }
+      for (int j = begin; j < end; ++j) { // visit every topic of the doc once
+        int k = asg[j];
+        int cnt = nkd(k);
+        if (cnt == 0) {
+          continue;
+        }
+        llh += (cnt < LGAMMA_TABLE)
+               ? lgamma_alpha_[(size_t)k * LGAMMA_TABLE + cnt]
+               : LogGamma(cnt + (double)alpha_(k)) - LogGamma((double)alpha_(k));
+        nkd(k) = 0;
+      }
+      llh -= LogGamma(end - begin + (double)alpha_sum_);
     }
-    llh -= nd * log(nd + alpha_sum_);
+    return llh;
+  });
+}
+
+real Trainer::evaluate_joint(double doc_llh, const SparseCount& nkw, const IArray& nk) {
+  doc_llh += num_train_doc_ * LogGamma((double)alpha_sum_);
+  int K = *num_topic;
+  double model_llh = 0.0;
+  for (int k = 0; k < K; ++k) {
+    model_llh += LogGamma((double)beta_sum_) - LogGamma(nk(k) + (double)beta_sum_);
   }
-  return llh / (real)(train_.num_token_);
+  model_llh += parallel_sum(nkw.NumWord(), [this, &nkw](int w_begin, int w_end) {
+    double llh = 0.0;
+    for (int w = w_begin; w < w_end; ++w) {
+      for (auto pair : nkw.Row(w)) {
+        llh += (pair.cnt_ < LGAMMA_TABLE)
+               ? lgamma_beta_[pair.cnt_]
+               : LogGamma(pair.cnt_ + (double)beta_) - LogGamma((double)beta_);
+      }
+    }
+    return llh;
+  });
+
+  return (doc_llh + model_llh) / (real)(num_train_token_);
+}
+
+double Trainer::llh_doc_term(const SparseCount& nkw, const IArray& nk, const NarrowArray& asg) {
+  // p(w) = sum_k (nkd + alpha) (nkw + beta) / denom, split as
+  // beta * sum_k (nkd + alpha) / denom plus a sparse sum over the nkw row
+  int K = *num_topic;
+  EArray denom = EREAL(nk) + beta_sum_;
+  EArray base = alpha_ / denom;
+  real smooth = base.sum();
+  return parallel_sum(train_.num_doc_, [&](int doc_begin, int doc_end) {
+    IArray nkd = IArray::Zero(K);
+    EArray coeff = base; // (nkd + alpha) / denom
+    double llh = 0.0;
+    for (int d = doc_begin; d < doc_end; ++d) {
+      int begin = train_.Begin(d);
+      int end = train_.End(d);
+      int nd = end - begin;
+      real doc_term = smooth;
+      for (int j = begin; j < end; ++j) {
+        int k = asg[j];
+        ++nkd(k);
+        doc_term += 1 / denom(k);
+        coeff(k) = (nkd(k) + alpha_(k)) / denom(k);
+      }
+      for (int j = begin; j < end; ++j) {
+        real s = Simd::Dot(nkw.Row(train_.tok_[j]), coeff.data(), beta_ * doc_term);
+        llh += log(s);
+      }
+      llh -= nd * log(nd + (double)alpha_sum_);
+      for (int j = begin; j < end; ++j) {
+        int k = asg[j];
+        nkd(k) = 0;
+        coeff(k) = base(k);
+      }
+    }
+    return llh;
+  });
 }
 
-real Trainer::evaluate_test_llh() {
+real Trainer::evaluate_test_llh(const SparseCount& nkw, const IArray& nk) {
   if (test_.num_doc_ == 0) {
     return 0.0;
   }
-  for (auto& doc : test_.corpus_) {
-    test_one_document(doc);
+  Zone zone("evaluate_test_llh");
+
+  // Fold in with the training counts fixed
+  int K = *num_topic;
+  test_denom_ = EREAL(nk + test_nk_) + beta_sum_;
+  test_coeff_ = alpha_ / test_denom_;
+  EArray r = alpha_ * beta_ / test_denom_;
+  test_r_tree_.Build(r.data(), K);
+  r.setZero();
+  test_s_tree_.Build(r.data(), K);
+  for (int d = 0; d < test_.num_doc_; ++d) {
+    (this->*test_kernel_)(d, nkw, nk);
   }
+
+  // p(w) = sum_k (nkd + alpha) (nkw + test_nkw + beta) / denom, split as
+  // beta * sum_k (nkd + alpha) / denom plus sparse terms over both rows
+  auto& nkd = test_nkd_;
+  EArray& coeff = test_coeff_; // alpha / denom outside the current document
+  real smooth = coeff.sum();
   real test_llh = 0.0;
-  EArray denom = EREAL(nk_ + test_nk_) + beta_sum_;
-  EArray cached_term(*num_topic);
-  for (const auto& doc : test_.corpus_) {
-    cached_term = (EREAL(doc.test_nkd_) + alpha_) / denom;
-    int nd = doc.body_.size();
-    for (int n = 0; n < nd; ++n) {
-      int word_id = doc.body_[n].tok_;
-      real s = (cached_term
-                * (nkw_[word_id].Array(*num_topic)
-                   + EREAL(test_nkw_.col(word_id)) + beta_)).sum();
+  for (int d = 0; d < test_.num_doc_; ++d) {
+    int begin = test_.Begin(d);
+    int end = test_.End(d);
+    int nd = end - begin;
+    real doc_term = smooth;
+    for (int j = begin; j < end; ++j) {
+      int k = test_.asg_[j];
+      ++nkd(k);
+      doc_term += 1 / test_denom_(k);
+      coeff(k) = (nkd(k) + alpha_(k)) / test_denom_(k);
+    }
+    for (int j = begin; j < end; ++j) {
+      int word_id = test_.tok_[j];
+      real s = Simd::Dot(nkw.Row(word_id), coeff.data(), beta_ * doc_term);
+      s = Simd::Dot(test_nkw_.Row(word_id), coeff.data(), s);
       test_llh += log(s);
     }
     test_llh -= nd * log(nd + alpha_sum_);
+    for (int j = begin; j < end; ++j) {
+      int k = test_.asg_[j];
+      nkd(k) = 0;
+      coeff(k) = alpha_(k) / test_denom_(k);
+    }
   }
   return test_llh / (real)(test_.num_token_);
 }
 
-void Trainer::test_one_document(Document& doc) {
-  std::vector<real> cumsum(*num_topic);
+// Gibbs fold-in of one held-out document. The t bucket walks the training
+// row and the held-out row of the word, so a token costs about as much as
+// in train_one_document instead of O(K). Same template arguments, Entry is
+// the width of nkw_, held-out rows dispatch on their own width per row.
+template <typename Asg, typename Entry, int KMAX>
+void Trainer::test_one_document(int d, const SparseCount& train_nkw, const IArray& train_nk) {
+  int *nkd = test_nkd_.data();
+  real *denom = test_denom_.data();
+  real *coeff = test_coeff_.data();
+  const int *nk = train_nk.data();
+  int *test_nk = test_nk_.data();
+  const real *alpha = alpha_.data();
+  const real beta = beta_, beta_sum = beta_sum_;
+  const int shift = (sizeof(Entry) == 8) ? 32 : KMAX ? FTree::log2_of(KMAX) : train_nkw.shift_;
+  const Entry mask = ((Entry)1 << shift) - 1;
+  auto& r_tree = test_r_tree_;
+  auto& s_tree = test_s_tree_;
+  auto& cumsum = test_cumsum_;
+  const auto& tok = test_.tok_;
+  Asg *asg = test_.asg_.Typed<Asg>();
+  int begin = test_.Begin(d);
+  int end = test_.End(d);
+  for (int j = begin; j < end; ++j) {
+    ++nkd[asg[j]];
+  }
+
+  // Refresh the buckets of one topic after its counts changed
+  auto update = [&](int k) {
+    denom[k] = nk[k] + test_nk[k] + beta_sum;
+    r_tree.Set<KMAX>(k, alpha[k] * beta / denom[k]);
+    s_tree.Set<KMAX>(k, nkd[k] * beta / denom[k]);
+    coeff[k] = (nkd[k] + alpha[k]) / denom[k];
+  };
+  for (int j = begin; j < end; ++j) {
+    update(asg[j]);
+  }
+
   for (int iter = 1; iter <= MAX_TEST_ITER; ++iter) {
-    for (size_t n = 0; n < doc.body_.size(); ++n) {
-      int word_id   = doc.body_[n].tok_;
-      int old_topic = doc.body_[n].asg_;
-      --doc.test_nkd_(old_topic);
-      --test_nkw_(old_topic,word_id);
-      --test_nk_(old_topic);
-      real sum = 0.0;
-      EArray dense_nkw = nkw_[word_id].Array(*num_topic);
-      for (int k = 0; k < *num_topic; ++k) {
-        sum += (doc.test_nkd_(k) + alpha_(k))
-               * (dense_nkw(k) + test_nkw_(k,word_id) + beta_)
-               / (nk_(k) + test_nk_(k) + beta_sum_);
-        cumsum[k] = sum;
+    for (int j = begin; j < end; ++j) {
+      // Localize
+      int word_id   = tok[j];
+      int old_topic = asg[j];
+      auto train_word = train_nkw.Row(word_id);
+      auto test_word = test_nkw_.Row(word_id);
+      const Entry *entry = reinterpret_cast<const Entry*>(train_word.data_);
+      int train_size = train_word.size();
+      int test_size = test_word.size();
+
+      // Decrement, test_word is updated once the new topic is known
+      --nkd[old_topic];
+      --test_nk[old_topic];
+      update(old_topic);
+
+      // Taking advantage of sparsity
+      if ((int)cumsum.size() < train_size + test_size) {
+        cumsum.resize(train_size + test_size);
       }
-      real r = Unif01() * sum;
-      int new_topic = std::lower_bound(RANGE(cumsum), r) - cumsum.begin();
-      ++doc.test_nkd_(new_topic);
-      ++test_nkw_(new_topic,word_id);
-      ++test_nk_(new_topic);
-      doc.body_[n].asg_ = new_topic;
-    }
+      real *head = cumsum.data();
+      real t_sum = Simd::PrefixSum(entry, train_size, shift, coeff, -1, 0.0f, head);
+      t_sum = Simd::PrefixSum(test_word, coeff, old_topic, t_sum, head + train_size);
+
+      // Draw
+      real r_sum = r_tree.Sum();
+      real s_sum = s_tree.Sum();
+      real u = Unif01() * (r_sum + s_sum + t_sum);
+      int new_topic = -1;
+      if (u < t_sum) {
+        int index = Simd::LowerBound(head, train_size + test_size, u);
+        new_topic = (index < train_size)
+                    ? (int)(entry[index] & mask)
+                    : test_word[index - train_size].top_;
+      } // end of t bucket
+      else {
+        u -= t_sum;
+        if (u < s_sum) {
+          new_topic = s_tree.Sample<KMAX>(u);
+        } // end of s bucket
+        else {
+          new_topic = r_tree.Sample<KMAX>(std::min(u - s_sum, r_sum));
+        } // end of r bucket
+      }
+
+      // Increment
+      ++nkd[new_topic];
+      ++test_nk[new_topic];
+      update(new_topic);
+
+      // Set
+      if (new_topic != old_topic) {
+        asg[j] = new_topic;
+        test_nkw_.UpdateCount(word_id, old_topic, new_topic);
+      }
+    } // end of iter over tokens
   } // end of iter
+
+  for (int j = begin; j < end; ++j) { // leave nkd and s_tree empty for the next doc
+    int k = asg[j];
+    nkd[k] = 0;
+    s_tree.Set<KMAX>(k, 0.0);
+    coeff[k] = alpha[k] / denom[k];
+  }
 }
 
 void Trainer::save_result() {
+  Timer save_timer("save_result");
+  std::string model_file = *dump_prefix + ".model";
+  ModelHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic_, MODEL_MAGIC, sizeof(h.magic_));
+  h.version_ = MODEL_VERSION;
+  bool has_assignment = *dump_assignment and *stream_file == "";
+  if (*dump_assignment and !has_assignment) {
+    lg.Printf("assignments stay in %s, not saved with the model", stream_file->c_str());
+  }
+  h.flags_ = has_assignment ? MODEL_HAS_ASSIGNMENT : 0;
+  if (has_assignment and file_tok_.size() > 0) { // training is over, blocks go
+    unsort_word_blocks();
+  }
+  h.num_topic_ = *num_topic;
+  h.num_word_ = dict.size_;
+  h.word_bytes_ = dict.arena_.size();
+  h.num_doc_ = num_train_doc_;
+  h.num_token_ = num_train_token_;
+  h.tok_width_ = train_.tok_.width_;
+  h.asg_width_ = train_.asg_.width_;
+  h.beta_ = beta_;
+  h.beta_sum_ = beta_sum_;
+  h.num_iter_ = start_iter_ + *num_iter;
+
+  // Flatten nkw_ rows, by original word id
+  std::vector<int64_t> row_offset(1, 0);
+  for (int w = 0; w < nkw_.NumWord(); ++w) {
+    row_offset.push_back(row_offset.back() + nkw_.Size(word_label(w)));
+  }
+  h.num_pair_ = row_offset.back();
+  std::vector<SparseCount::CountPair> pair;
+  pair.reserve(h.num_pair_);
+  for (int w = 0; w < nkw_.NumWord(); ++w) {
+    for (auto p : nkw_.Row(word_label(w))) {
+      pair.push_back(p);
+    }
+  }
+
+  Writer writer(model_file.c_str());
+  writer.Put(&h, sizeof(h));
+  writer.Put(alpha_.data(), *num_topic * sizeof(float));
+  writer.Put(nk_.data(), *num_topic * sizeof(int32_t));
+  writer.Put(row_offset.data(), row_offset.size() * sizeof(int64_t));
+  writer.Put(pair.data(), pair.size() * sizeof(SparseCount::CountPair));
+  writer.Put(dict.id_offset_.data(), dict.id_offset_.size() * sizeof(uint64_t));
+  writer.Put(dict.arena_.data(), dict.arena_.size());
+  if (has_assignment and (!word_label_.empty() or !doc_origin_.empty())) {
+    // Documents in file order, tokens with their original word ids
+    std::vector<int> position(train_.num_doc_); // original index to document
+    for (int d = 0; d < train_.num_doc_; ++d) {
+      position[doc_origin_.empty() ? d : doc_origin_[d]] = d;
+    }
+    std::vector<int> origin(nkw_.NumWord());
+    for (int w = 0; w < nkw_.NumWord(); ++w) {
+      origin[word_label(w)] = w;
+    }
+    std::vector<int32_t> doc_offset(1, 0);
+    NarrowArray tok, asg;
+    tok.Init(train_.num_token_, (1LL << (8 * train_.tok_.width_)) - 1); // width in the header
+    asg.Init(train_.num_token_, *num_topic - 1);
+    int j = 0;
+    for (int d : position) {
+      for (int i = train_.Begin(d); i < train_.End(d); ++i, ++j) {
+        tok.Set(j, origin[train_.tok_[i]]);
+        asg.Set(j, train_.asg_[i]);
+      }
+      doc_offset.push_back(j);
+    }
+    writer.Put(doc_offset.data(), doc_offset.size() * sizeof(int32_t));
+    writer.Put(tok.data(), tok.Bytes());
+    writer.Put(asg.data(), asg.Bytes());
+  } else if (has_assignment) {
+    std::vector<int32_t> doc_offset(RANGE(train_.offset_));
+    writer.Put(doc_offset.data(), doc_offset.size() * sizeof(int32_t));
+    writer.Put(train_.tok_.data(), (size_t)train_.num_token_ * train_.tok_.width_);
+    writer.Put(train_.asg_.data(), (size_t)train_.num_token_ * train_.asg_.width_);
+  }
+  if (!writer.Close()) {
+    lg.Fatalf("cannot write model: %s", model_file.c_str());
+  }
+  lg.Printf("model saved to %s", model_file.c_str());
 }
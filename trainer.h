@@ -1,27 +1,167 @@
 #pragma once
 
+#include "rng.h"
+#include "alias.h"
+#include "ftree.h"
+#include "model.h"
 #include "corpus.h"
+#include "metrics.h"
+#include "segment.h"
+#include "simd.h"
 #include "sparse_count.h"
 
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// Per-thread sampling state. With several data-parallel threads every worker
+// samples its own document range against private copies of the counts,
+// which are merged back into the shared model after each sweep (AD-LDA).
+// Model-parallel workers update the shared word counts in place, one word
+// block at a time, and only keep nk private.
+struct Worker {
+  SparseCount *nkw_ = NULL; // K x V, topic word counts sampled against
+  SparseCount local_nkw_; // K x V, private copy, data-parallel only
+  IArray nk_; // K x 1, local topic counts
+  int doc_begin_, doc_end_; // document range [begin, end)
+
+  // SparseLDA sampler only
+  FTree r_tree_, s_tree_; // K x 1, smoothing and doc-specific buckets
+  EArray denom_; // K x 1, nk + beta_sum
+  EArray t_coeff_; // K x 1, (nkd + alpha) / denom, alpha / denom between docs
+  std::vector<real> t_cumsum_; // prefix sums over one nkw row
+
+  IArray nkd_; // K x 1, counts of the current document, zero in between
+  uint64_t stream_ = 0; // sweep part of the Philox stream of every document
+  std::vector<float> uniform_; // uniforms of the current document
+
+  // Metropolis-Hastings alias sampler only
+  std::vector<AliasTable> word_alias_; // V x 1, nkw / (nk + beta_sum)
+  AliasTable dense_alias_; // K x 1, beta / (nk + beta_sum)
+  std::vector<int> alias_topic_; // scratch for building tables
+  std::vector<real> alias_weight_;
+
+  SamplerMetrics metrics_; // hot path counters since the last iteration
+};
+
+// One evaluation of the model after sweep iter_. Synchronous evaluations
+// read the live state, asynchronous ones own a snapshot taken right after
+// the sweep, so sampling can go on while they run.
+struct EvalJob {
+  int iter_;
+  double sec_; // mean sweep time since the last evaluation
+  SamplerMetrics metrics_; // sampler counters since the last evaluation
+  size_t worker_bytes_; // private worker counts at the time
+  bool snapshot_ = false; // the copies below are set
+  SparseCount nkw_;
+  IArray nk_;
+  NarrowArray asg_;
+};
+
+enum SamplerType { SAMPLER_SPARSE, SAMPLER_ALIAS };
+enum SweepOrder { SWEEP_DOC, SWEEP_WORD };
+enum ParallelScheme { PARALLEL_DATA, PARALLEL_MODEL };
+
 class Trainer {
 public:
   void Train(); // parameter estimation on training dataset
+  friend struct Bench; // times the private stages, see bench/bench.cc
 
 private:
   void initialize(); // TODO: fix header, compile
-  void train_one_document(Document& doc);
-  real evaluate_joint();
-  real evaluate_llh();
-  real evaluate_test_llh();
-  void test_one_document(Document& doc);
+  void restore_checkpoint(const ModelView& model);
+  void start_online(const ModelView& model);
+  void relabel();
+  void build_word_major_index();
+  void partition_documents();
+  void build_word_blocks();
+  void unsort_word_blocks();
+  int lower_token(int d, int word_id) const;
+  template <typename F>
+  void for_each_batch(bool write_back, F fn);
+  void build_lgamma_table();
+  void sweep(int iter);
+  void sample_documents(int seed);
+  void sample_blocks(int seed);
+  void doc_phase();
+  void word_phase();
+  void reset_buckets(Worker& worker);
+  void merge_topic_counts();
+  void merge_workers();
+  void select_kernels();
+  template <typename Entry>
+  void select_kernels(int asg_width, int k_class);
+  template <typename Asg, typename Entry, int KMAX>
+  void use_kernels();
+  void sample_one_document(int d, int first, int last, Worker& worker);
+  template <typename Asg, typename Entry, int KMAX>
+  void train_one_document(int d, int first, int last, Worker& worker);
+  void train_one_document_alias(int d, int first, int last, Worker& worker);
+  void build_word_alias(Worker& worker, int word_id);
+  void build_dense_alias(Worker& worker);
+  void evaluate(int iter);
+  void evaluate_job(const EvalJob& job);
+  void evaluation_loop();
+  void finish_evaluation();
+  double joint_doc_term(const NarrowArray& asg);
+  real evaluate_joint(double doc_llh, const SparseCount& nkw, const IArray& nk);
+  double llh_doc_term(const SparseCount& nkw, const IArray& nk, const NarrowArray& asg);
+  real evaluate_test_llh(const SparseCount& nkw, const IArray& nk);
+  template <typename Asg, typename Entry, int KMAX>
+  void test_one_document(int d, const SparseCount& train_nkw, const IArray& train_nk);
+  void write_metrics(const EvalJob& job, const SparseCount& nkw);
   void save_result();
+  int word_label(int original) const;
 
 private:
-  Corpus train_, test_; // train/test documents
-  std::vector<SparseCount> nkw_; // K x V, topic word counts
-  IMAtrix test_nkw_; // K x V, topic word counts
+  Corpus train_, test_; // train/test documents, train_ is one minibatch when streaming
+  SegmentFile stream_; // on-disk training corpus when streaming
+  long long num_train_doc_, num_train_token_; // whole training corpus
+  int num_sample_doc_ = -1; // documents sampled by a sweep, a prefix of train_, -1 for all
+  SparseCount nkw_; // K x V, topic word counts
+  std::vector<int> word_label_; // original word id to relabeled, empty if not relabeled
+  std::vector<int> doc_origin_; // document to its original index, empty if not reordered
+  SparseCount test_nkw_; // K x V, held-out topic word counts
   IArray nk_, test_nk_; // K x 1, topic counts
   EArray alpha_; // K x 1
   real alpha_sum_, beta_, beta_sum_;
+  AliasTable alpha_alias_; // K x 1, doc proposal prior
+  std::vector<double> lgamma_alpha_; // K x LGAMMA_TABLE, lgamma(n + alpha_k) - lgamma(alpha_k)
+  std::vector<double> lgamma_beta_; // LGAMMA_TABLE, lgamma(n + beta) - lgamma(beta)
+  SamplerType sampler_;
+  // SparseLDA kernels for the assignment width, nkw entry width and K class
+  void (Trainer::*train_kernel_)(int d, int first, int last, Worker& worker) = NULL;
+  void (Trainer::*test_kernel_)(int d, const SparseCount& train_nkw, const IArray& train_nk) = NULL;
+  SweepOrder sweep_order_;
+  ParallelScheme parallel_ = PARALLEL_DATA;
+  std::vector<int> block_begin_; // W+1, first word of every block, model-parallel only
+  NarrowArray file_tok_; // train_.tok_ before build_word_blocks() sorted it
+
+  // Word-major sweep only
+  std::vector<int> word_offset_; // V+1, slot range of every word
+  std::vector<int> doc_slot_; // N x 1, word-major slot of every token in doc order
+  std::vector<int> slot_topic_, slot_proposal_; // N x 1, in word-major order
+  IArray word_nkw_; // K x 1, dense row of the word in the word phase
+  std::vector<SparseCount::CountPair> word_pair_; // nonzero entries of word_nkw_
+
+  // Held-out fold-in, same bucket decomposition as the SparseLDA sampler
+  IArray test_nkd_; // K x 1, counts of the current test document, zero in between
+  FTree test_r_tree_, test_s_tree_; // K x 1, smoothing and doc-specific buckets
+  EArray test_denom_; // K x 1, nk + test_nk + beta_sum
+  EArray test_coeff_; // K x 1, (nkd + alpha) / test_denom
+  std::vector<real> test_cumsum_; // t bucket over the train and test rows
+  std::vector<Worker> worker_;
+  int start_iter_ = 0; // sweeps done before this run, when resumed
   std::vector<real> iter_time_, joint_, llh_, test_llh_;
+  double eval_sec_ = 0.0; // sweep time since the last evaluation
+  int eval_sweep_ = 0; // sweeps since the last evaluation
+
+  // Asynchronous evaluation, -async_eval only
+  std::thread eval_thread_;
+  std::mutex eval_mutex_; // guards the queue and eval_done_
+  std::condition_variable eval_cv_;
+  std::deque<EvalJob> eval_queue_; // snapshots waiting for the evaluation thread
+  bool eval_done_ = false; // no more snapshots
+  FILE *metrics_fp_ = NULL; // -metrics_file, one JSON line per iteration
 };
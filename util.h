@@ -9,17 +9,16 @@
 #define RANGE(x) ((x).begin()), ((x).end())
 #define SUM(x)   (std::accumulate(RANGE(x), .0))
 
-// Random hack
-#include <chrono>
-#include <random>
-#define CLOCK (std::chrono::system_clock::now().time_since_epoch().count())
-static std::mt19937 _rng(CLOCK);
-static std::uniform_real_distribution<double> _unif01;
+// Random hack, for serial code. Samplers draw from Philox streams, see rng.h
+static thread_local int _jxr = 1234567; // per-thread stream
 
-static int _jxr = 1234567;
+inline static void SeedUnif01(unsigned seed) { // reseed the calling thread
+  seed = (seed + 0x9e3779b9u) * 0x85ebca6bu;
+  seed ^= seed >> 13;
+  _jxr = (int)(seed | 1); // xorshift state must be nonzero
+}
 
 inline static float Unif01() {
-  //return _unif01(_rng);
   _jxr ^= (_jxr << 13);
   _jxr ^= (_jxr >> 17);
   _jxr ^= (_jxr << 5);
@@ -30,6 +29,12 @@ inline static int Dice(int n) {
   return (int)(Unif01() * n);
 }
 
+// lgamma() sets the global signgam, evaluators call this from several threads
+inline static double LogGamma(double x) {
+  int sign;
+  return lgamma_r(x, &sign);
+}
+
 // Eigen
 #define EIGEN_INITIALIZE_MATRICES_BY_ZERO
 #define EIGEN_DEFAULT_IO_FORMAT \
@@ -0,0 +1,72 @@
+// Writer for mmap-able binary files.
+//
+// Usage:
+//   Writer writer("model.bin");
+//   writer.Put(&header, sizeof(header)); // every section is 8-byte aligned
+//   writer.Put(data, size);
+//   if (!writer.Close()) { ... }
+//
+// Note:
+// - Data goes to a unique <file>.XXXXXX, which is synced and renamed on
+//   Close(), so concurrent readers never map a partial file and concurrent
+//   writers never share one.
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+struct Writer {
+  FILE *fp_;
+  std::string file_, tmp_file_;
+  bool ok_;
+
+  static size_t Align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+  }
+
+  Writer(const char* file) : fp_(NULL), file_(file), tmp_file_(file_ + ".XXXXXX") {
+    int fd = mkstemp(&tmp_file_[0]);
+    if (fd >= 0) {
+      fchmod(fd, 0644); // mkstemp creates 0600
+      fp_ = fdopen(fd, "wb");
+      if (fp_ == NULL) {
+        close(fd);
+        remove(tmp_file_.c_str());
+      }
+    }
+    ok_ = (fp_ != NULL);
+  }
+
+  ~Writer() {
+    if (fp_ != NULL) { // not closed, discard
+      fclose(fp_);
+      remove(tmp_file_.c_str());
+    }
+  }
+
+  void Put(const void *data, size_t size) {
+    static const char pad[8] = {0};
+    if (ok_) {
+      ok_ = fwrite(data, 1, size, fp_) == size
+            and fwrite(pad, 1, Align8(size) - size, fp_) == Align8(size) - size;
+    }
+  }
+
+  bool Close() {
+    if (fp_ == NULL) {
+      return false;
+    }
+    ok_ = ok_ and fflush(fp_) == 0 and fsync(fileno(fp_)) == 0;
+    ok_ = (fclose(fp_) == 0) and ok_;
+    fp_ = NULL;
+    if (ok_) {
+      ok_ = rename(tmp_file_.c_str(), file_.c_str()) == 0;
+    } else {
+      remove(tmp_file_.c_str());
+    }
+    return ok_;
+  }
+};